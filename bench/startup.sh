@@ -0,0 +1,83 @@
+#!/bin/sh
+# Measures paup's startup latency against a private Xvfb and a private
+# pulseaudio with a null sink, so no desktop session or sound card is
+# involved. paup --bench prints the duration of each startup phase as
+# JSON and exits after the first frame; this runs it repeatedly and
+# prints p50/p95/p99 per phase, in milliseconds, as one JSON object.
+#
+# Xvfb runs no window manager and leaves the focus on PointerRoot, so
+# paup falls back to a root child and waits FIRST_FRAME_SETTLE for a
+# resize that never comes. That wait is reported as wm_wait, and
+# first_frame_work is first_frame without it; compare the latter.
+#
+# usage: bench/startup.sh [runs] [paup binary]
+# Needs Xvfb, pulseaudio and python3. BENCH_DISPLAY picks the display
+# number (default 99).
+
+set -eu
+
+runs=${1:-50}
+paup=${2:-./paup}
+display=:${BENCH_DISPLAY:-99}
+
+for tool in Xvfb pulseaudio python3; do
+	command -v "$tool" >/dev/null || { echo "startup.sh: $tool not found" >&2; exit 1; }
+done
+
+tmp=$(mktemp -d)
+cleanup() {
+	[ -n "${pulse_pid:-}" ] && kill "$pulse_pid" 2>/dev/null
+	[ -n "${xvfb_pid:-}" ] && kill "$xvfb_pid" 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+# Waits up to five seconds for a socket to appear.
+wait_for() {
+	i=0
+	while [ ! -S "$1" ]; do
+		i=$((i + 1))
+		[ $i -gt 100 ] && { echo "startup.sh: $2 did not start" >&2; exit 1; }
+		sleep 0.05
+	done
+}
+
+Xvfb "$display" -screen 0 1280x800x24 -nolisten tcp >"$tmp/xvfb.log" 2>&1 &
+xvfb_pid=$!
+wait_for "/tmp/.X11-unix/X${display#:}" Xvfb
+
+# Nothing from the user's configuration is loaded: only the protocol
+# socket and a null sink, which becomes the default sink.
+export HOME="$tmp" XDG_RUNTIME_DIR="$tmp" XDG_CONFIG_HOME="$tmp/config"
+export PULSE_SERVER="unix:$tmp/native"
+pulseaudio -n --daemonize=no --use-pid-file=no --exit-idle-time=-1 \
+	--load="module-native-protocol-unix socket=$tmp/native auth-anonymous=1" \
+	--load="module-null-sink sink_name=bench" >"$tmp/pulse.log" 2>&1 &
+pulse_pid=$!
+wait_for "$tmp/native" pulseaudio
+
+i=0
+while [ $i -lt "$runs" ]; do
+	DISPLAY=$display "$paup" --bench >>"$tmp/runs.jsonl"
+	i=$((i + 1))
+done
+
+python3 - "$tmp/runs.jsonl" "$runs" <<'PY'
+import json, math, sys
+
+runs = [json.loads(line) for line in open(sys.argv[1]) if line.strip()]
+if len(runs) != int(sys.argv[2]):
+    sys.exit("startup.sh: %d of %s runs reported timings" % (len(runs), sys.argv[2]))
+
+def percentile(values, p):
+    # Nearest rank.
+    values = sorted(values)
+    return values[max(0, math.ceil(p / 100 * len(values)) - 1)]
+
+phases = {}
+for phase in runs[0]:
+    values = [run[phase] for run in runs]
+    phases[phase] = {"p%d" % p: round(percentile(values, p), 3) for p in (50, 95, 99)}
+print(json.dumps({"runs": len(runs), "unit": "ms", "phases": phases}))
+PY
@@ -0,0 +1,60 @@
+#pragma once
+
+// Control protocol between paupctl and `paup --daemon`. Every command is
+// one fixed-size datagram on a UNIX socket; there are no replies. The
+// header is shared by both sides and only needs libc, so it stays valid
+// C as well as C++.
+
+// C
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PAUP_CTL_MAGIC   0x50415550u  // "PAUP"
+#define PAUP_CTL_VERSION 1
+
+enum paup_ctl_cmd
+{
+	PAUP_CTL_SHOW = 1,           // show the overlay
+	PAUP_CTL_VOLUME_ADJUST = 2,  // arg: volume change in percent
+	PAUP_CTL_VOLUME_SET = 3,     // arg: volume in percent
+	PAUP_CTL_MUTE_TOGGLE = 4,
+	PAUP_CTL_MUTE_SET = 5,       // arg: 1 mutes, 0 unmutes
+};
+
+struct paup_ctl_msg
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t cmd;
+	int32_t arg;
+};
+
+// $XDG_RUNTIME_DIR/paup.sock, or /tmp/paup-$UID.sock without a runtime
+// directory. Returns -1 if the path does not fit.
+static inline int paup_ctl_socket_path(char *buf, size_t size)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	int n = (dir && *dir) ? snprintf(buf, size, "%s/paup.sock", dir) : snprintf(buf, size, "/tmp/paup-%u.sock", (unsigned)getuid());
+	return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+// The /tmp fallback is shared with every other user, who could create the
+// path first and collect our commands or pose as a running daemon. Returns
+// -1 with errno set to EPERM if something other than a socket of ours is
+// already there; a missing path is fine.
+static inline int paup_ctl_socket_check(const char *path)
+{
+	struct stat st;
+	if (lstat(path, &st) < 0) return errno == ENOENT ? 0 : -1;
+	if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+		errno = EPERM;
+		return -1;
+	}
+	return 0;
+}
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,228 @@
+// Self
+#include "fake.h"
+
+// C
+#include <err.h>
+#include <poll.h>
+
+// C++
+#include <algorithm>
+#include <thread>
+
+FakeMixer::FakeMixer(Reactor &reactor, std::chrono::nanoseconds latency)
+	: reactor_(reactor)
+	, latency_(latency)
+{
+	AddDevice(Device(DeviceType::SINK, 0, "fake_sink", "Fake Sink", 50, false));
+	AddDevice(Device(DeviceType::SOURCE, 0, "fake_source", "Fake Source", 50, false));
+	AddDevice(Device(DeviceType::SINK_INPUT, 0, "fake_stream", "Fake Stream", 100, false));
+	defaults_.sink = "fake_sink";
+	defaults_.source = "fake_source";
+}
+
+FakeMixer::~FakeMixer()
+{
+	for (auto &[key, write] : volume_writes_) {
+		reactor_.RemoveTimer(write.timer);
+	}
+}
+
+std::vector<Device> &FakeMixer::devices_of(DeviceType type)
+{
+	switch (type) {
+		case DeviceType::SINK:
+			return sinks_;
+		case DeviceType::SOURCE:
+			return sources_;
+		case DeviceType::SINK_INPUT:
+			return sink_inputs_;
+		case DeviceType::SOURCE_OUTPUT:
+			return source_outputs_;
+	}
+	throw unreachable();
+}
+
+void FakeMixer::AddDevice(Device device)
+{
+	devices_of(device.Type()).push_back(std::move(device));
+}
+
+// Stands in for a round trip to the server.
+void FakeMixer::wait()
+{
+	if (latency_ > std::chrono::nanoseconds::zero()) std::this_thread::sleep_for(latency_);
+}
+
+void FakeMixer::notify(ChangeType change, DeviceType type, uint32_t index)
+{
+	if (subscribed_) changes_.push_back({change, type, index});
+}
+
+void FakeMixer::set_volume(Device &device, long value)
+{
+	device.volume_percent_ = static_cast<int>(std::max(value, 0L));
+}
+
+void FakeMixer::Populate(PopulateMode mode __attribute__((unused)))
+{
+	wait();
+}
+
+Device *FakeMixer::PopulateDefault(DeviceType type)
+{
+	wait();
+	return GetDevice(defaults_.GetDefault(type), type);
+}
+
+Device *FakeMixer::GetDevice(const uint32_t index, DeviceType type)
+{
+	auto &devices = devices_of(type);
+	auto it = std::find_if(devices.begin(), devices.end(), [index](const Device &d) { return d.Index() == index; });
+	return it != devices.end() ? &*it : nullptr;
+}
+
+Device *FakeMixer::GetDevice(const std::string &name, DeviceType type)
+{
+	auto &devices = devices_of(type);
+	auto it = std::find_if(devices.begin(), devices.end(), [&name](const Device &d) { return d.Name() == name; });
+	return it != devices.end() ? &*it : nullptr;
+}
+
+const std::vector<Device> &FakeMixer::GetDevices(DeviceType type)
+{
+	return devices_of(type);
+}
+
+bool FakeMixer::SetVolume(Device &device, long value)
+{
+	wait();
+	set_volume(device, value);
+	counters_.writes++;
+	notify(ChangeType::DEVICE_CHANGED, device.Type(), device.Index());
+	return true;
+}
+
+bool FakeMixer::QueueVolume(Device &device, long value)
+{
+	set_volume(device, value);
+
+	Key key = {device.Type(), device.Index()};
+	auto it = volume_writes_.find(key);
+	if (it == volume_writes_.end()) {
+		int timer = reactor_.AddTimer([this, key]() { volume_written(key); });
+		it = volume_writes_.emplace(key, VolumeWrite{timer, false, std::nullopt}).first;
+	}
+
+	VolumeWrite &write = it->second;
+	if (write.in_flight) {
+		if (write.next) counters_.coalesced++;
+		write.next = value;
+	} else {
+		send_volume(write);
+	}
+	return true;
+}
+
+void FakeMixer::send_volume(VolumeWrite &write)
+{
+	write.in_flight = true;
+	write.next.reset();
+	counters_.writes++;
+	reactor_.ArmTimer(write.timer, latency_);
+}
+
+// The fake server acknowledged a write; like the daemon it reports the
+// device as changed, and the newest queued target is sent next.
+void FakeMixer::volume_written(const Key &key)
+{
+	VolumeWrite &write = volume_writes_.at(key);
+	write.in_flight = false;
+	notify(ChangeType::DEVICE_CHANGED, key.first, key.second);
+	if (write.next) send_volume(write);
+}
+
+void FakeMixer::Drain()
+{
+	// The reactor no longer runs at exit, so pending writes are completed
+	// here after a single wait.
+	bool pending = false;
+	for (auto &[key, write] : volume_writes_) {
+		if (!write.in_flight && !write.next) continue;
+		pending = true;
+		reactor_.DisarmTimer(write.timer);
+		if (write.next) counters_.writes++;
+		write.in_flight = false;
+		write.next.reset();
+	}
+	if (pending) wait();
+}
+
+bool FakeMixer::SetMute(Device &device, bool mute)
+{
+	wait();
+	device.mute_ = mute;
+	counters_.writes++;
+	notify(ChangeType::DEVICE_CHANGED, device.Type(), device.Index());
+	return true;
+}
+
+bool FakeMixer::Move(Device &source, Device &dest)
+{
+	bool valid = (source.Type() == DeviceType::SINK_INPUT && dest.Type() == DeviceType::SINK) || (source.Type() == DeviceType::SOURCE_OUTPUT && dest.Type() == DeviceType::SOURCE);
+	if (!valid) {
+		warnx("only sink inputs and source outputs can be moved, to a sink or source.");
+		return false;
+	}
+
+	wait();
+	notify(ChangeType::DEVICE_CHANGED, source.Type(), source.Index());
+	return true;
+}
+
+bool FakeMixer::Kill(Device &device)
+{
+	if (device.Type() != DeviceType::SINK_INPUT && device.Type() != DeviceType::SOURCE_OUTPUT) {
+		warnx("only sink inputs and source outputs can be killed.");
+		return false;
+	}
+
+	wait();
+	DeviceType type = device.Type();
+	uint32_t index = device.Index();
+	auto &devices = devices_of(type);
+	devices.erase(std::remove_if(devices.begin(), devices.end(), [index](const Device &d) { return d.Index() == index; }), devices.end());
+	notify(ChangeType::DEVICE_REMOVED, type, index);
+	return true;
+}
+
+void FakeMixer::Subscribe()
+{
+	subscribed_ = true;
+}
+
+void FakeMixer::SetChangeCallback(ChangeCallback callback)
+{
+	change_callback_ = std::move(callback);
+}
+
+void FakeMixer::Iterate(bool block)
+{
+	// There is no server to wait for, only the wakeup fd.
+	if (block && changes_.empty() && wakeup_fd_ >= 0) {
+		struct pollfd pfd = {wakeup_fd_, POLLIN, 0};
+		poll(&pfd, 1, -1);
+	}
+
+	std::vector<Change> changes;
+	changes.swap(changes_);
+	for (auto const &c : changes) {
+		if (change_callback_) change_callback_(c.change, c.type, c.index);
+	}
+}
+
+void FakeMixer::SetWakeupFd(int fd)
+{
+	wakeup_fd_ = fd;
+}
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "mixer.h"
+#include "reactor.h"
+
+// C++
+#include <chrono>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// In-memory Mixer for benchmarking input handling and the event loop
+// without a sound server. It starts out with one sink, one source and one
+// sink input. Blocking operations sleep for the configured latency.
+// Queued volume writes complete after the same latency on a reactor timer
+// and are coalesced like PulseClient's, so a given input sequence always
+// produces the same writes.
+class FakeMixer : public Mixer
+{
+public:
+	FakeMixer(Reactor &reactor, std::chrono::nanoseconds latency);
+	~FakeMixer();
+
+	FakeMixer(const FakeMixer &) = delete;
+	FakeMixer &operator=(const FakeMixer &) = delete;
+
+	struct Counters
+	{
+		// Volume and mute writes that reached the fake server.
+		unsigned long writes = 0;
+		// Queued volume targets replaced before they were sent.
+		unsigned long coalesced = 0;
+	};
+	const Counters &GetCounters() const { return counters_; }
+
+	// Adds a device. Its index must be unique within its type.
+	void AddDevice(Device device);
+
+	void Populate(PopulateMode mode = PopulateMode::PIPELINED) override;
+	Device *PopulateDefault(DeviceType type) override;
+
+	Device *GetDevice(const uint32_t index, DeviceType type) override;
+	Device *GetDevice(const std::string &name, DeviceType type) override;
+	const std::vector<Device> &GetDevices(DeviceType type) override;
+	const ServerInfo &GetDefaults() const override { return defaults_; }
+
+	bool SetVolume(Device &device, long value) override;
+	bool QueueVolume(Device &device, long value) override;
+	void Drain() override;
+
+	bool SetMute(Device &device, bool mute) override;
+
+	bool Move(Device &source, Device &dest) override;
+	bool Kill(Device &device) override;
+
+	void Subscribe() override;
+	void SetChangeCallback(ChangeCallback callback) override;
+	void Iterate(bool block) override;
+	void SetWakeupFd(int fd) override;
+
+private:
+	struct Change
+	{
+		ChangeType change;
+		DeviceType type;
+		uint32_t index;
+	};
+
+	struct VolumeWrite
+	{
+		int timer;
+		bool in_flight;
+		std::optional<long> next;
+	};
+
+	using Key = std::pair<DeviceType, uint32_t>;
+
+	std::vector<Device> &devices_of(DeviceType type);
+	void wait();
+	void notify(ChangeType change, DeviceType type, uint32_t index);
+	void set_volume(Device &device, long value);
+	void send_volume(VolumeWrite &write);
+	void volume_written(const Key &key);
+
+	Reactor &reactor_;
+	std::chrono::nanoseconds latency_;
+	std::vector<Device> sinks_;
+	std::vector<Device> sources_;
+	std::vector<Device> sink_inputs_;
+	std::vector<Device> source_outputs_;
+	ServerInfo defaults_;
+	bool subscribed_ = false;
+	ChangeCallback change_callback_;
+	std::vector<Change> changes_;
+	std::map<Key, VolumeWrite> volume_writes_;
+	Counters counters_;
+	int wakeup_fd_ = -1;
+};
+
+// vim: set et ts=2 sw=2:
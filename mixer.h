@@ -0,0 +1,153 @@
+#pragma once
+
+// C
+#include <stdint.h>
+
+// C++
+#include <any>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum class DeviceType
+{
+	SINK,
+	SOURCE,
+	SINK_INPUT,
+	SOURCE_OUTPUT,
+};
+
+// A sink, source, sink input or source output as every backend sees it.
+// Whatever else a backend needs to know about the device is kept in the
+// backend slot, which only that backend reads.
+class Device
+{
+public:
+	Device(DeviceType type, uint32_t index, std::string name, std::string desc, int volume, bool mute, int balance = 0, std::any backend = {})
+		: type_(type)
+		, index_(index)
+		, name_(std::move(name))
+		, desc_(std::move(desc))
+		, volume_percent_(volume)
+		, balance_(balance)
+		, mute_(mute)
+		, backend_(std::move(backend))
+	{
+	}
+
+	uint32_t Index() const { return index_; }
+	const std::string &Name() const { return name_; }
+	const std::string &Desc() const { return desc_; }
+	int Volume() const { return volume_percent_; }
+	int Balance() const { return balance_; }
+	bool Muted() const { return mute_; }
+	DeviceType Type() const { return type_; }
+
+private:
+	friend class PulseClient;
+	friend class FakeMixer;
+
+	DeviceType type_;
+	uint32_t index_;
+	std::string name_;
+	std::string desc_;
+	int volume_percent_;
+	int balance_;
+	bool mute_;
+	std::any backend_;
+};
+
+struct ServerInfo
+{
+	std::string sink;
+	std::string source;
+	std::string empty = "";
+
+	const std::string &GetDefault(DeviceType type)
+	{
+		switch (type) {
+			case DeviceType::SINK:
+				return sink;
+			case DeviceType::SOURCE:
+				return source;
+			default:
+				return empty;
+		}
+	}
+};
+
+class unreachable : public std::runtime_error
+{
+public:
+	unreachable() throw()
+		: std::runtime_error("unreachable code path encountered")
+	{
+	}
+
+	unreachable(const std::string &message) throw()
+		: std::runtime_error(message)
+	{
+	}
+};
+
+// The sound server as paup sees it. PulseClient talks to a pulse daemon;
+// FakeMixer keeps everything in memory so the event loop can be driven
+// without one.
+class Mixer
+{
+public:
+	virtual ~Mixer() {}
+
+	enum class PopulateMode
+	{
+		// Wait for each introspection query before sending the next one.
+		SERIAL,
+		// Send all introspection queries at once and drain the replies
+		// in a single mainloop pass.
+		PIPELINED,
+	};
+
+	enum class ChangeType
+	{
+		// A known device was updated or a new one appeared.
+		DEVICE_CHANGED,
+		DEVICE_REMOVED,
+		// The default sink or source changed. The index is UINT32_MAX.
+		DEFAULTS_CHANGED,
+	};
+	using ChangeCallback = std::function<void(ChangeType change, DeviceType type, uint32_t index)>;
+
+	// Loads every device, or only the default sink or source.
+	virtual void Populate(PopulateMode mode = PopulateMode::PIPELINED) = 0;
+	virtual Device *PopulateDefault(DeviceType type) = 0;
+
+	virtual Device *GetDevice(const uint32_t index, DeviceType type) = 0;
+	virtual Device *GetDevice(const std::string &name, DeviceType type) = 0;
+	virtual const std::vector<Device> &GetDevices(DeviceType type) = 0;
+	virtual const ServerInfo &GetDefaults() const = 0;
+
+	// SetVolume waits for the server; QueueVolume updates the device at
+	// once and coalesces writes until Drain().
+	virtual bool SetVolume(Device &device, long value) = 0;
+	virtual bool QueueVolume(Device &device, long value) = 0;
+	virtual void Drain() = 0;
+
+	virtual bool SetMute(Device &device, bool mute) = 0;
+
+	// Move a sink input or source output to another sink or source, or
+	// kill it.
+	virtual bool Move(Device &source, Device &dest) = 0;
+	virtual bool Kill(Device &device) = 0;
+
+	// Changes are only reported from Iterate(), so device references stay
+	// valid between calls to it. A blocking Iterate() also returns once
+	// the wakeup fd is readable.
+	virtual void Subscribe() = 0;
+	virtual void SetChangeCallback(ChangeCallback callback) = 0;
+	virtual void Iterate(bool block) = 0;
+	virtual void SetWakeupFd(int fd) = 0;
+};
+
+// vim: set et ts=2 sw=2:
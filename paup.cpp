@@ -3,24 +3,46 @@
 
 // [RUN] make && ./paup
 
+#include "ctl.h"
+#include "fake.h"
+#include "mixer.h"
 #include "pulse.h"
+#include "present.h"
+#include "reactor.h"
+#include "render.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/xcb_keysyms.h>
 #include <xcb/xproto.h>
 #include <xcb/xcb_util.h>
 #include <X11/keysymdef.h>
 
+#include <signal.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
 #include <initializer_list>
 #include <iostream>
 #include <map>
 #include <typeinfo>
 #include <vector>
 #include <cassert>
+#include <climits>
 #include <cstdarg>
+#include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <chrono>
-#include <thread>
+#include <future>
+#include <memory>
 
 #define XCB_MOD_MASK_SHIFT   1
 #define XCB_MOD_MASK_LOCK    2
@@ -34,6 +56,16 @@
 								   using namespace std;
 
 static bool g_debug = false;
+static int g_bench_populate = 0;
+static bool g_grab_keyboard = false;
+static bool g_full_populate = false;
+static int g_fps = 60;
+static bool g_software_render = false;
+static bool g_present = false;
+static bool g_daemon = false;
+static bool g_bench = false;
+static bool g_fake_backend = false;
+static std::chrono::microseconds g_fake_latency(0);
 
 // Unified debug/info print
 void debugf(const char *fmt, ...)
@@ -57,6 +89,23 @@ namespace xcl
 class Window;
 class Connection;
 
+// Atoms the overlay refers to. The names are fixed at compile time and
+// the values are interned in one batch by internAtoms(), so lookups are a
+// plain array index. Only the daemon needs them.
+enum class Atom : size_t
+{
+	WM_STATE,
+	WM_NAME,
+	NET_ACTIVE_WINDOW,
+	COUNT,
+};
+
+constexpr array<const char *, static_cast<size_t>(Atom::COUNT)> atomNames = {
+	"WM_STATE",
+	"WM_NAME",
+	"_NET_ACTIVE_WINDOW",
+};
+
 class Window
 {
 public:
@@ -73,74 +122,257 @@ protected:
 	Connection &con_;
 };
 
+struct Rgb
+{
+	uint8_t r, g, b;
+};
+
+struct KeyGrab
+{
+	uint32_t modifier;
+	xcb_keysym_t keysym;
+};
+
 class Connection
 {
 public:
 	vector<Window> windows;
 
-	Connection(map<string, xcb_atom_t> atoms);
-	Connection(initializer_list<string> atoms);
+	Connection();
+
+	vector<xcb_atom_t> readAtoms(const vector<string> &atoms);
+	void internAtoms();
+	xcb_atom_t atom(Atom atom) const
+	{
+		assert(atoms_interned_);
+		return atoms_[static_cast<size_t>(atom)];
+	}
 
-	xcb_atom_t readAtom(string atom);
-	void grabKey(uint32_t cmodifier, uint32_t ckey);
+	vector<KeyGrab> grabKeys(const vector<KeyGrab> &keys);
+	void grabKeysUnchecked(const vector<KeyGrab> &keys);
+	bool grabKeyboard();
+	void ungrabKeys();
+	vector<uint32_t> allocColors(const vector<Rgb> &colors);
 
 	xcb_connection_t *handle() const { return handle_; }
 	xcb_key_symbols_t *symbols() const { return symbols_; }
 	xcb_screen_t *screen() const { return screen_; }
+	xcb_visualtype_t *visual() const { return visual_; }
 
 protected:
 	xcb_connection_t *handle_;
-	map<string, xcb_atom_t> atoms_;
+	array<xcb_atom_t, static_cast<size_t>(Atom::COUNT)> atoms_;
+	bool atoms_interned_ = false;
 	xcb_key_symbols_t *symbols_;
 	xcb_screen_t *screen_;
+	xcb_visualtype_t *visual_;
 };
 
-xcb_atom_t Connection::readAtom(std::string atomId)
+// Sends every intern request before waiting for the first reply, so the
+// whole batch costs a single round trip.
+vector<xcb_atom_t> Connection::readAtoms(const vector<string> &atomIds)
+{
+	vector<xcb_intern_atom_cookie_t> cookies;
+	cookies.reserve(atomIds.size());
+	for (auto const &atomId : atomIds) {
+		cookies.push_back(xcb_intern_atom(this->handle(), 0, atomId.size(), atomId.c_str()));
+	}
+
+	vector<xcb_atom_t> result;
+	result.reserve(atomIds.size());
+	string failed;
+	for (size_t i = 0; i < cookies.size(); ++i) {
+		auto const reply = stats::Blocking("xcb_intern_atom_reply", [&] { return xcb_intern_atom_reply(this->handle(), cookies[i], NULL); });
+		if (!reply) {
+			debugf("Failed to get atom '%s'\n", atomIds[i].c_str());
+			failed = atomIds[i];
+			result.push_back(XCB_ATOM_NONE);
+			continue;
+		}
+		debugf("Read atom '%s' -> %lu\n", atomIds[i].c_str(), (unsigned long)reply->atom);
+		result.push_back(reply->atom);
+		free(reply);
+	}
+
+	// All replies are collected first so none are left queued on the connection.
+	if (!failed.empty()) {
+		throw std::runtime_error("Failed to read atom: " + failed);
+	}
+	return result;
+}
+
+// Sends a grab for every keycode of every key before checking any of
+// them, so the batch costs a single round trip. Returns the keys that
+// could not be grabbed.
+vector<KeyGrab> Connection::grabKeys(const vector<KeyGrab> &keys)
+{
+	struct PendingGrab
+	{
+		size_t key;
+		xcb_void_cookie_t cookie;
+	};
+	vector<PendingGrab> pending;
+	vector<bool> failed(keys.size(), false);
+
+	for (size_t i = 0; i < keys.size(); ++i) {
+		auto keycodes = xcb_key_symbols_get_keycode(this->symbols(), keys[i].keysym);
+		if (!keycodes || *keycodes == XCB_NO_SYMBOL) {
+			debugf("xcb_key_symbols_get_keycode returned NULL for keycode: %u\n", keys[i].keysym);
+			failed[i] = true;
+			free(keycodes);
+			continue;
+		}
+		for (auto keycode = keycodes; *keycode != XCB_NO_SYMBOL; ++keycode) {
+			auto const cookie = xcb_grab_key_checked(this->handle(), 1, this->screen()->root, keys[i].modifier, *keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+			pending.push_back({i, cookie});
+		}
+		free(keycodes);
+	}
+
+	for (auto const &grab : pending) {
+		xcb_generic_error_t *err = stats::Blocking("xcb_request_check", [&] { return xcb_request_check(this->handle(), grab.cookie); });
+		if (err) {
+			debugf("Key grab failed: key=0x%x, cmodifier=0x%x, error_code=%d\n", keys[grab.key].keysym, keys[grab.key].modifier, err->error_code);
+			failed[grab.key] = true;
+			free(err);
+		}
+	}
+
+	vector<KeyGrab> result;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		if (failed[i]) {
+			result.push_back(keys[i]);
+		} else {
+			debugf("Key grab success: key=0x%x, cmodifier=0x%x\n", keys[i].keysym, keys[i].modifier);
+		}
+	}
+	return result;
+}
+
+// Sends the same grabs as grabKeys() without waiting for the server. A
+// grab that fails shows up as an error event in the event loop.
+void Connection::grabKeysUnchecked(const vector<KeyGrab> &keys)
 {
-	auto const internAtom = xcb_intern_atom(this->handle(), 0, atomId.size(), atomId.c_str());
-	auto const reply = xcb_intern_atom_reply(this->handle(), internAtom, NULL);
+	for (auto const &key : keys) {
+		auto keycodes = xcb_key_symbols_get_keycode(this->symbols(), key.keysym);
+		if (!keycodes || *keycodes == XCB_NO_SYMBOL) {
+			debugf("xcb_key_symbols_get_keycode returned NULL for keycode: %u\n", key.keysym);
+			free(keycodes);
+			continue;
+		}
+		for (auto keycode = keycodes; *keycode != XCB_NO_SYMBOL; ++keycode) {
+			xcb_grab_key(this->handle(), 1, this->screen()->root, key.modifier, *keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+		}
+		free(keycodes);
+	}
+}
+
+// Grabs the whole keyboard with a single request instead of grabbing
+// individual keys.
+bool Connection::grabKeyboard()
+{
+	auto const cookie = xcb_grab_keyboard(this->handle(), 1, this->screen()->root, XCB_CURRENT_TIME, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+	auto const reply = stats::Blocking("xcb_grab_keyboard_reply", [&] { return xcb_grab_keyboard_reply(this->handle(), cookie, NULL); });
 	if (!reply) {
-		debugf("Failed to get atom '%s'\n", atomId.c_str());
-		throw std::runtime_error("Failed to read atom: " + atomId);
+		debugf("xcb_grab_keyboard_reply failed\n");
+		return false;
 	}
-	auto result = reply->atom;
-	debugf("Read atom '%s' -> %lu\n", atomId.c_str(), (unsigned long)result);
+	auto const status = reply->status;
 	free(reply);
-	return result;
+	if (status != XCB_GRAB_STATUS_SUCCESS) {
+		debugf("Keyboard grab failed: status=%u\n", status);
+		return false;
+	}
+	debugf("Keyboard grab success\n");
+	return true;
 }
 
-void Connection::grabKey(uint32_t cmodifier, uint32_t ckey)
+// Releases every grab made through grabKeys() and grabKeyboard().
+void Connection::ungrabKeys()
 {
-	auto key = xcb_key_symbols_get_keycode(this->symbols(), ckey);
-	if (!key) {
-		debugf("xcb_key_symbols_get_keycode returned NULL for keycode: %u\n", ckey);
-		return;
+	xcb_ungrab_key(this->handle(), XCB_GRAB_ANY, this->screen()->root, XCB_MOD_MASK_ANY);
+	xcb_ungrab_keyboard(this->handle(), XCB_CURRENT_TIME);
+}
+
+// Scales an 8 bit channel into the bits selected by a visual's mask.
+static uint32_t channelToPixel(uint8_t value, uint32_t mask)
+{
+	if (!mask) return 0;
+	const int shift = __builtin_ctz(mask);
+	const uint32_t max = mask >> shift;
+	return ((value * max + 127) / 255) << shift;
+}
+
+// Resolves pixel values for the root visual. On TrueColor and DirectColor
+// visuals the pixel is computed from the channel masks without asking the
+// server; other visuals allocate every colour in one batch from the
+// default colormap.
+vector<uint32_t> Connection::allocColors(const vector<Rgb> &colors)
+{
+	vector<uint32_t> result;
+	result.reserve(colors.size());
+
+	auto const visual = this->visual();
+	if (visual && (visual->_class == XCB_VISUAL_CLASS_TRUE_COLOR || visual->_class == XCB_VISUAL_CLASS_DIRECT_COLOR)) {
+		for (auto const &c : colors) {
+			result.push_back(channelToPixel(c.r, visual->red_mask) | channelToPixel(c.g, visual->green_mask) | channelToPixel(c.b, visual->blue_mask));
+		}
+		debugf("Computed %zu colour(s) locally from the visual masks\n", colors.size());
+		return result;
 	}
-	auto const reply = xcb_grab_key(this->handle(), 1, this->screen()->root, cmodifier, *key, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
 
-	xcb_generic_error_t *err = xcb_request_check(this->handle(), reply);
-	if (err) {
-		debugf("Key grab failed: key=0x%x, cmodifier=0x%x, error_code=%d\n", ckey, cmodifier, err->error_code);
-		free(err);
-	} else {
-		debugf("Key grab success: key=0x%x, cmodifier=0x%x\n", ckey, cmodifier);
+#define RGB_8_TO_16(i) (65535 * ((i) & 0xFF) / 255)
+	vector<xcb_alloc_color_cookie_t> cookies;
+	cookies.reserve(colors.size());
+	for (auto const &c : colors) {
+		cookies.push_back(xcb_alloc_color(this->handle(), this->screen()->default_colormap, RGB_8_TO_16(c.r), RGB_8_TO_16(c.g), RGB_8_TO_16(c.b)));
 	}
+#undef RGB_8_TO_16
+
+	bool failed = false;
+	for (auto const &cookie : cookies) {
+		auto const reply = stats::Blocking("xcb_alloc_color_reply", [&] { return xcb_alloc_color_reply(this->handle(), cookie, NULL); });
+		if (!reply) {
+			debugf("xcb_alloc_color_reply failed\n");
+			failed = true;
+			result.push_back(0);
+			continue;
+		}
+		result.push_back(reply->pixel);
+		free(reply);
+	}
+
+	if (failed) {
+		throw std::runtime_error("Color allocation failed");
+	}
+	return result;
 }
 
-Connection::Connection(initializer_list<string> initialAtomsId)
+Connection::Connection()
 {
-	this->handle_ = xcb_connect(NULL, NULL);
+	this->handle_ = stats::Blocking("xcb_connect", [] { return xcb_connect(NULL, NULL); });
 	if (xcb_connection_has_error(this->handle_)) {
 		debugf("xcb_connect failed\n");
 		throw std::runtime_error("xcb_connect failed");
 	}
 	this->screen_ = xcb_setup_roots_iterator(xcb_get_setup(this->handle_)).data;
+	this->visual_ = nullptr;
+	for (auto depth = xcb_screen_allowed_depths_iterator(this->screen_); depth.rem && !this->visual_; xcb_depth_next(&depth)) {
+		for (auto visual = xcb_depth_visuals_iterator(depth.data); visual.rem; xcb_visualtype_next(&visual)) {
+			if (visual.data->visual_id == this->screen_->root_visual) {
+				this->visual_ = visual.data;
+				break;
+			}
+		}
+	}
 	this->symbols_ = xcb_key_symbols_alloc(this->handle_);
+}
 
-	this->atoms_ = map<string, xcb_atom_t>();
-	for (auto atomId : initialAtomsId) {
-		atoms_.insert({atomId, readAtom(atomId)});
-	}
+void Connection::internAtoms()
+{
+	auto const values = readAtoms(vector<string>(atomNames.begin(), atomNames.end()));
+	std::copy(values.begin(), values.end(), this->atoms_.begin());
+	this->atoms_interned_ = true;
 }
 
 Window::Window(Connection &con)
@@ -149,17 +381,6 @@ Window::Window(Connection &con)
 	this->handle_ = xcb_generate_id(con.handle());
 }
 
-inline Window newXCBSubWindow(Connection &con, uint16_t width, uint16_t height, uint32_t eventmask, xcb_window_t parent)
-{
-	auto w = Window(con);
-	w.width = width;
-	w.height = height;
-	const auto mask = XCB_CW_EVENT_MASK;
-	const uint32_t values[1] = {eventmask};
-	xcb_create_window(con.handle(), (uint8_t)XCB_COPY_FROM_PARENT, w.handle(), parent, (int16_t)20, (int16_t)20, width, height, (uint16_t)0, (uint16_t)XCB_WINDOW_CLASS_INPUT_OUTPUT, con.screen()->root_visual, (uint32_t)mask, values);
-	return w;
-}
-
 uint32_t newGC(Connection &con, uint32_t mask, uint32_t values[2])
 {
 	auto result = xcb_generate_id(con.handle());
@@ -172,339 +393,1189 @@ uint32_t newGC(Connection &con, uint32_t mask, uint32_t values[2])
 
 using namespace xcl;
 
-auto con = Connection({"WM_STATE", "WM_NAME", "_NET_ACTIVE_WINDOW"});
-uint32_t background, foreground, foreground_muted, buffer;
+// Both connections are established in init(): the X side on the main
+// thread and the pulse side concurrently on a worker thread.
+std::unique_ptr<Connection> con;
+uint32_t background, foreground, foreground_muted, buffer = 0;
 xcb_window_t subwin;
+
+const uint32_t OVERLAY_EVENT_MASK = XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_KEY_RELEASE | XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_FOCUS_CHANGE | XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_LEAVE_WINDOW | XCB_EVENT_MASK_ENTER_WINDOW | XCB_EVENT_MASK_PROPERTY_CHANGE;
+const vector<KeyGrab> OVERLAY_KEYS = {{0, XK_j}, {0, XK_k}, {0, XK_q}, {0, XK_m}, {0, XK_Escape}};
+
+// Whether the overlay is mapped; frames are only drawn while it is.
+bool overlay_visible = false;
+
+// Set when the overlay is drawn on the client (--render software) instead
+// of with core fill requests into a pixmap.
+std::unique_ptr<SoftwareRenderer> software;
+
+// Set when frames are shown through the Present extension (--present)
+// instead of being copied to the window right away.
+std::unique_ptr<Presenter> presenter;
+
+// A frame was requested while the previous one was still being shown; it
+// is drawn once the server reports completion.
+bool frame_pending = false;
 static bool used_fallback = false; // new global
 
+// Size the overlay is created with. The current size is tracked from
+// ConfigureNotify, so drawing never has to ask the server for it.
+const uint16_t DEFAULT_WIDTH = 40, DEFAULT_HEIGHT = 130;
+uint16_t win_width = DEFAULT_WIDTH, win_height = DEFAULT_HEIGHT;
+
 int vol = 0;
 bool muted = false;
 const int MAX_VOL = 100;
 Device *device;
+uint32_t device_index;
 ServerInfo defaults;
 const char *opt_device;
 uint32_t col01;
 
-PulseClient pulsecl("paup");
+Reactor reactor;
+// The sound server backend: PulseClient, or FakeMixer with --backend fake.
+// Declared after the reactor, whose timers FakeMixer uses.
+std::unique_ptr<Mixer> mixer;
 
-// Fetch current window geometry (width, height)
-bool get_window_size(xcb_connection_t *conn, xcb_window_t win, uint16_t &w, uint16_t &h)
+// Renders at most once per frame interval. State changes only mark the
+// overlay dirty; drawing happens from a reactor timer, so input bursts
+// never produce more frames than the cap allows.
+class FrameScheduler
 {
-	xcb_get_geometry_cookie_t geom_cookie = xcb_get_geometry(conn, win);
-	xcb_get_geometry_reply_t *geom = xcb_get_geometry_reply(conn, geom_cookie, NULL);
-	if (geom) {
-		w = geom->width;
-		h = geom->height;
-		free(geom);
-		return true;
-	} else {
-		w = 40;
-		h = 130;
-		return false;
+public:
+	void Init(Reactor &reactor, int fps, std::function<void()> render)
+	{
+		reactor_ = &reactor;
+		interval_ = std::chrono::nanoseconds(1000000000 / std::max(fps, 1));
+		render_ = std::move(render);
+		timer_ = reactor.AddTimer([this]() { tick(); });
 	}
+
+	void MarkDirty()
+	{
+		dirty_ = true;
+		if (!reactor_ || reactor_->TimerArmed(timer_)) return;
+		reactor_->ArmTimer(timer_, last_frame_ + interval_ - std::chrono::steady_clock::now());
+	}
+
+private:
+	void tick()
+	{
+		if (!dirty_) return;
+		dirty_ = false;
+		last_frame_ = std::chrono::steady_clock::now();
+		render_();
+	}
+
+	Reactor *reactor_ = nullptr;
+	int timer_ = -1;
+	bool dirty_ = false;
+	std::chrono::nanoseconds interval_;
+	std::chrono::steady_clock::time_point last_frame_;
+	std::function<void()> render_;
+};
+
+FrameScheduler frames;
+
+// What the back buffer currently shows. A volume step only repaints the
+// strip between the old and new bar height; resizes and colour changes
+// repaint everything.
+int drawn_level = -1;
+bool drawn_muted = false;
+
+void invalidate()
+{
+	drawn_level = -1;
 }
 
-void draw()
+// The back buffer follows the window size. It grows in steps of
+// BUFFER_STEP pixels and only shrinks once the window uses less than a
+// quarter of it, so small resizes do not reallocate it every time.
+const uint16_t BUFFER_STEP = 64;
+uint16_t buffer_width = 0, buffer_height = 0;
+
+// Rounded in 32 bits: near the protocol limit the next step would wrap a
+// uint16_t to 0.
+uint16_t round_up_to_step(uint16_t size)
 {
-	const auto conhandle = con.handle();
-	uint16_t win_width = 40, win_height = 130;
-	get_window_size(conhandle, subwin, win_width, win_height);
+	const uint32_t rounded = (uint32_t(size) + BUFFER_STEP - 1) / BUFFER_STEP * BUFFER_STEP;
+	return static_cast<uint16_t>(std::min<uint32_t>(rounded, UINT16_MAX));
+}
 
-	uint16_t pme = static_cast<uint16_t>(((float)win_height / 100.0f) * (float)vol);
+void resize_buffer(uint16_t width, uint16_t height)
+{
+	const auto conhandle = con->handle();
+
+	// The software renderer keeps its own image instead of a pixmap.
+	if (software) {
+		software->Resize(width, height);
+		return;
+	}
+
+	bool grow = width > buffer_width || height > buffer_height;
+	bool shrink = buffer && (uint32_t)width * height * 4 < (uint32_t)buffer_width * buffer_height;
+	if (buffer && !grow && !shrink) return;
+
+	if (buffer) {
+		xcb_free_pixmap(conhandle, buffer);
+		width = round_up_to_step(width);
+		height = round_up_to_step(height);
+	}
 
-	xcb_rectangle_t fg_rects = {0, static_cast<int16_t>(win_height - pme), win_width, pme};
-	xcb_rectangle_t bg_rects = {0, 0, win_width, win_height};
+	// Errors are reported through the event loop like any other request.
+	buffer = xcb_generate_id(conhandle);
+	xcb_create_pixmap(conhandle, con->screen()->root_depth, buffer, subwin, width, height);
+	buffer_width = width;
+	buffer_height = height;
+	invalidate();
+	debugf("Back buffer is now %ux%u\n", width, height);
+}
 
-	xcb_poly_fill_rectangle(conhandle, buffer, background, 1, &bg_rects);
-	if (muted) {
-		xcb_poly_fill_rectangle(conhandle, buffer, foreground_muted, 1, &fg_rects);
+void free_buffer()
+{
+	if (!buffer) return;
+	xcb_free_pixmap(con->handle(), buffer);
+	buffer = 0;
+	buffer_width = buffer_height = 0;
+}
+
+// Puts an area of the back buffer on screen. Through Present the whole
+// buffer is queued for the next vertical blank.
+void show(int16_t x, int16_t y, uint16_t width, uint16_t height)
+{
+	if (presenter) {
+		presenter->Present(subwin, buffer);
 	} else {
-		xcb_poly_fill_rectangle(conhandle, buffer, foreground, 1, &fg_rects);
+		xcb_copy_area(con->handle(), buffer, subwin, foreground, x, y, x, y, width, height);
 	}
+}
+
+void draw()
+{
+	trace::Span span("draw", "render");
+	const auto conhandle = con->handle();
+
+	if (software) {
+		// The shared image is still being read by the server; the frame is
+		// drawn once it reports completion.
+		if (software->Busy()) {
+			frame_pending = true;
+			return;
+		}
+		software->Draw(subwin, foreground, vol, muted);
+		xcb_flush(conhandle);
+		return;
+	}
+
+	// The back buffer must not change until the queued frame was shown.
+	if (presenter && presenter->Busy()) {
+		frame_pending = true;
+		return;
+	}
+
+	uint16_t pme = static_cast<uint16_t>(((float)win_height / 100.0f) * (float)vol);
+	auto const bar = muted ? foreground_muted : foreground;
+
+	if (drawn_level < 0 || drawn_muted != muted) {
+		xcb_rectangle_t fg_rects = {0, static_cast<int16_t>(win_height - pme), win_width, pme};
+		xcb_rectangle_t bg_rects = {0, 0, win_width, win_height};
+
+		xcb_poly_fill_rectangle(conhandle, buffer, background, 1, &bg_rects);
+		xcb_poly_fill_rectangle(conhandle, buffer, bar, 1, &fg_rects);
+		show(0, 0, win_width, win_height);
+		debugf("Redrew, vol=%d muted=%d size=%ux%u\n", vol, muted, win_width, win_height);
+	} else if (pme != drawn_level) {
+		// Growing the bar paints the strip in the bar colour, shrinking it
+		// paints the strip in the background colour.
+		uint16_t low = std::min<uint16_t>(pme, drawn_level), high = std::max<uint16_t>(pme, drawn_level);
+		xcb_rectangle_t strip = {0, static_cast<int16_t>(win_height - high), win_width, static_cast<uint16_t>(high - low)};
+
+		xcb_poly_fill_rectangle(conhandle, buffer, pme > drawn_level ? bar : background, 1, &strip);
+		show(strip.x, strip.y, strip.width, strip.height);
+		debugf("Redrew strip, vol=%d rows=%d..%d\n", vol, strip.y, strip.y + strip.height);
+	}
+
 	xcb_flush(conhandle);
-	xcb_copy_area(conhandle, buffer, subwin, foreground, 0, 0, 0, 0, win_width, win_height);
-	xcb_flush(conhandle);
-	debugf("Redrew, vol=%d muted=%d size=%ux%u\n", vol, muted, win_width, win_height);
+	drawn_level = pme;
+	drawn_muted = muted;
 }
 
-uint32_t get_colorpixel(uint16_t r, uint16_t g, uint16_t b)
+// Startup phases timed for --bench, which prints them as one JSON object
+// and exits after the first frame (see bench/startup.sh). Each slot is
+// written by a single thread; the pulse thread's are read after joining it.
+enum class Phase : size_t
 {
-#define RGB_8_TO_16(i) (65535 * ((i) & 0xFF) / 255)
-	int r16 = RGB_8_TO_16(r);
-	int g16 = RGB_8_TO_16(g);
-	int b16 = RGB_8_TO_16(b);
+	X_CONNECT,
+	PULSE_CONNECT,
+	POPULATE,
+	WINDOW,
+	COLORS_GCS,
+	FIRST_DRAW,
+	WM_WAIT,
+	FIRST_FRAME,
+	FIRST_FRAME_WORK,
+	COUNT,
+};
 
-	xcb_alloc_color_reply_t *reply;
+constexpr array<const char *, static_cast<size_t>(Phase::COUNT)> phaseNames = {
+	"x_connect",
+	"pulse_connect",
+	"populate",
+	"window",
+	"colors_gcs",
+	"first_draw",
+	"wm_wait",
+	"first_frame",
+	"first_frame_work",
+};
 
-	reply = xcb_alloc_color_reply(con.handle(), xcb_alloc_color(con.handle(), con.screen()->default_colormap, r16, g16, b16), NULL);
+using bench_clock = std::chrono::steady_clock;
+const auto process_start = bench_clock::now();
+array<double, static_cast<size_t>(Phase::COUNT)> phase_ms = {};
+bool first_frame_done = false;
 
-	if (!reply) {
-		debugf("xcb_alloc_color_reply failed\n");
-		throw std::runtime_error("Color allocation failed");
+void record_phase(Phase phase, bench_clock::time_point since)
+{
+	phase_ms[static_cast<size_t>(phase)] = std::chrono::duration<double, std::milli>(bench_clock::now() - since).count();
+}
+
+void print_phases()
+{
+	printf("{");
+	for (size_t i = 0; i < phaseNames.size(); ++i) {
+		printf("%s\"%s\":%.3f", i ? "," : "", phaseNames[i], phase_ms[i]);
 	}
+	printf("}\n");
+}
 
-	uint32_t pixel = reply->pixel;
-	free(reply);
+void draw_first_frame()
+{
+	auto start = bench_clock::now();
+	invalidate();
+	draw();
+	if (!g_bench) return;
+
+	// The frame counts once the server has processed it.
+	const auto conhandle = con->handle();
+	auto cookie = xcb_get_input_focus(conhandle);
+	free(stats::Blocking("xcb_get_input_focus_reply", [&] { return xcb_get_input_focus_reply(conhandle, cookie, NULL); }));
+	record_phase(Phase::FIRST_DRAW, start);
+	record_phase(Phase::FIRST_FRAME, process_start);
+	// Time spent waiting for a window manager is not paup's own work;
+	// without one (e.g. under Xvfb) it is the fixed settle delay.
+	auto phase = [](Phase p) -> double & { return phase_ms[static_cast<size_t>(p)]; };
+	phase(Phase::FIRST_FRAME_WORK) = phase(Phase::FIRST_FRAME) - phase(Phase::WM_WAIT);
+	first_frame_done = true;
+	reactor.Stop();
+}
 
-	return pixel;
+// With the root fallback parent the window manager usually reparents and
+// resizes the overlay right after mapping it. The first frame waits for
+// that ConfigureNotify instead of being drawn at the default size; if the
+// size never changes it is drawn once the window was mapped for
+// FIRST_FRAME_SETTLE, or after FIRST_FRAME_TIMEOUT at the latest.
+const auto FIRST_FRAME_TIMEOUT = std::chrono::milliseconds(200);
+const auto FIRST_FRAME_SETTLE = std::chrono::milliseconds(16);
+bool awaiting_first_frame = false;
+int first_frame_timer = -1;
+bench_clock::time_point wm_wait_start;
+
+void first_frame()
+{
+	if (!awaiting_first_frame) return;
+	awaiting_first_frame = false;
+	reactor.RemoveTimer(first_frame_timer);
+	first_frame_timer = -1;
+	record_phase(Phase::WM_WAIT, wm_wait_start);
+
+	debugf("First frame at %ux%u\n", win_width, win_height);
+	draw_first_frame();
 }
 
-// --- New code for deferring the initial draw only if fallback is used ---
-void wait_for_valid_window_size_and_draw()
+void schedule_first_frame()
 {
-	const auto conhandle = con.handle();
-	if (used_fallback) {
-		const int max_attempts = 40; // wait up to ~200ms total (40 x 5ms)
-		int attempts = 0;
-		uint16_t w = 0, h = 0;
-		while (attempts < max_attempts) {
-			bool ok = get_window_size(conhandle, subwin, w, h);
-			if (ok && w > 1 && h > 1 && !(w == 40 && h == 130)) break;
-			std::this_thread::sleep_for(std::chrono::milliseconds(3));
-			xcb_flush(conhandle);
-			attempts++;
-		}
-		debugf("Window size detected after %d attempts: %ux%u\n", attempts, w, h);
+	if (!used_fallback) {
+		draw_first_frame();
+		return;
 	}
-	draw();
+
+	awaiting_first_frame = true;
+	wm_wait_start = bench_clock::now();
+	first_frame_timer = reactor.AddTimer(first_frame);
+	reactor.ArmTimer(first_frame_timer, FIRST_FRAME_TIMEOUT);
 }
-// --- End new code ---
 
-void init(int argc, char **argv)
+// Keeps the overlay in sync with changes made by other pulse clients.
+void on_mixer_change(Mixer::ChangeType change, DeviceType type, uint32_t index)
 {
-	for (int i = 1; i < argc; ++i) {
-		if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
-			g_debug = true;
-			break;
+	if (change == Mixer::ChangeType::DEFAULTS_CHANGED) {
+		defaults = mixer->GetDefaults();
+		opt_device = defaults.GetDefault(DeviceType::SINK).c_str();
+		if (Device *d = mixer->GetDevice(opt_device, DeviceType::SINK)) {
+			debugf("Default sink changed to '%s'\n", d->Name().c_str());
+			device_index = d->Index();
+			index = device_index;
 		}
+	} else if (type != DeviceType::SINK) {
+		return;
 	}
 
-	auto screen = con.screen();
-	auto conhandle = con.handle();
+	// Updates may have moved the device within the cache.
+	device = mixer->GetDevice(device_index, DeviceType::SINK);
+	if (!device) {
+		debugf("Default sink %u went away\n", device_index);
+		return;
+	}
+	if (index != device_index) return;
 
-	pulsecl.Populate();
+	if (device->Volume() != vol || device->Muted() != muted) {
+		vol = device->Volume();
+		muted = device->Muted();
+		frames.MarkDirty();
+	}
+}
 
-	auto getwin = xcb_get_input_focus(conhandle);
-	auto rep = xcb_get_input_focus_reply(conhandle, getwin, NULL);
-	if (!rep) {
-		debugf("xcb_get_input_focus_reply failed\n");
-		throw std::runtime_error("Failed to get input focus");
+void grab_overlay_keys()
+{
+	if (!g_grab_keyboard || !con->grabKeyboard()) {
+		auto failed = con->grabKeys(OVERLAY_KEYS);
+		if (!failed.empty()) {
+			debugf("%zu key grab(s) failed\n", failed.size());
+		}
 	}
-	auto parent = rep->focus;
-	free(rep);
+}
 
-	uint32_t windowmask = XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_KEY_PRESS | XCB_EVENT_MASK_KEY_RELEASE | XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_FOCUS_CHANGE | XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_LEAVE_WINDOW | XCB_EVENT_MASK_ENTER_WINDOW | XCB_EVENT_MASK_PROPERTY_CHANGE;
+// In daemon mode (--daemon) the connections, GCs, back buffer and the
+// overlay window outlive a single use. The window is an unmapped,
+// override-redirect child of the root, so showing it needs no window
+// manager round trip: it is moved next to the active window, raised,
+// mapped, focused and drawn. Dismissing it unmaps it again.
+//
+// Showing never waits on the server. The focus to restore and the result
+// of a keyboard grab are requested with the rest of the batch and picked
+// up by collect_overlay_replies() once they have arrived.
+xcb_window_t previous_focus = XCB_NONE;
+bool focus_query_pending = false;
+xcb_get_input_focus_cookie_t focus_query;
+bool keyboard_grab_pending = false;
+xcb_grab_keyboard_cookie_t keyboard_grab;
+
+// The position is kept up to date while the overlay is hidden, so a show
+// only uses coordinates that are already known. A change of the root's
+// _NET_ACTIVE_WINDOW, or the active window moving, starts a query for the
+// window and then for its position; both replies are collected like the
+// ones above. Without an EWMH window manager the overlay stays at 20,20.
+int16_t overlay_x = 20, overlay_y = 20;
+xcb_window_t active_window = XCB_NONE;
+bool active_query_pending = false;
+xcb_get_property_cookie_t active_query;
+bool position_query_pending = false;
+xcb_translate_coordinates_cookie_t position_query;
+
+// Takes the reply to a request nobody waits on if it has arrived. An
+// error reply yields a null reply.
+template <typename Reply>
+bool poll_reply(bool &pending, unsigned int sequence, Reply **reply)
+{
+	void *raw = nullptr;
+	xcb_generic_error_t *err = nullptr;
+	if (!pending || !xcb_poll_for_reply(con->handle(), sequence, &raw, &err)) return false;
+	pending = false;
+	free(err);
+	*reply = static_cast<Reply *>(raw);
+	return true;
+}
 
-	xcb_window_t overlay_parent = parent;
-	xcb_window_t window_id = xcb_generate_id(conhandle);
+void query_active_window()
+{
+	const auto conhandle = con->handle();
+	if (active_query_pending) xcb_discard_reply(conhandle, active_query.sequence);
+	active_query = xcb_get_property(conhandle, 0, con->screen()->root, con->atom(Atom::NET_ACTIVE_WINDOW), XCB_ATOM_WINDOW, 0, 1);
+	active_query_pending = true;
+}
 
-	xcb_generic_error_t *err = xcb_request_check(conhandle, xcb_create_window_checked(conhandle, (uint8_t)XCB_COPY_FROM_PARENT, window_id, overlay_parent, (int16_t)20, (int16_t)20, 40, 130, (uint16_t)0, (uint16_t)XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, XCB_CW_EVENT_MASK, &windowmask));
-	used_fallback = false;
-	if (err) {
-		debugf("Window creation failed with parent (focus): error_code=%d (falling back to root)\n", err->error_code);
-		free(err);
+void query_overlay_position()
+{
+	const auto conhandle = con->handle();
+	if (position_query_pending) xcb_discard_reply(conhandle, position_query.sequence);
+	position_query = xcb_translate_coordinates(conhandle, active_window, con->screen()->root, 20, 20);
+	position_query_pending = true;
+}
 
-		overlay_parent = screen->root;
-		window_id = xcb_generate_id(conhandle);
-		xcb_create_window(conhandle, (uint8_t)XCB_COPY_FROM_PARENT, window_id, overlay_parent, (int16_t)20, (int16_t)20, 40, 130, (uint16_t)0, (uint16_t)XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, XCB_CW_EVENT_MASK, &windowmask);
-		used_fallback = true;
+// Follows _NET_ACTIVE_WINDOW from now on.
+void track_active_window()
+{
+	const uint32_t values[1] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
+	xcb_change_window_attributes(con->handle(), con->screen()->root, XCB_CW_EVENT_MASK, values);
+	query_active_window();
+}
+
+void collect_overlay_replies()
+{
+	const auto conhandle = con->handle();
+
+	xcb_get_input_focus_reply_t *focus;
+	if (poll_reply(focus_query_pending, focus_query.sequence, &focus)) {
+		previous_focus = focus ? focus->focus : XCB_NONE;
+		free(focus);
 	}
-	subwin = window_id;
 
-	uint32_t values[2];
-	values[1] = 0;
+	xcb_grab_keyboard_reply_t *grab;
+	if (poll_reply(keyboard_grab_pending, keyboard_grab.sequence, &grab)) {
+		if (overlay_visible && (!grab || grab->status != XCB_GRAB_STATUS_SUCCESS)) {
+			debugf("Keyboard grab failed, grabbing the overlay keys instead\n");
+			con->grabKeysUnchecked(OVERLAY_KEYS);
+		}
+		free(grab);
+	}
+
+	xcb_get_property_reply_t *active;
+	if (poll_reply(active_query_pending, active_query.sequence, &active)) {
+		xcb_window_t window = XCB_NONE;
+		if (active && active->type == XCB_ATOM_WINDOW && xcb_get_property_value_length(active) == sizeof(xcb_window_t)) {
+			window = *static_cast<xcb_window_t *>(xcb_get_property_value(active));
+		}
+		free(active);
+
+		// Moves of the active window arrive as ConfigureNotify from now on.
+		if (window != active_window && window != subwin) {
+			uint32_t values[1] = {XCB_EVENT_MASK_NO_EVENT};
+			if (active_window != XCB_NONE) xcb_change_window_attributes(conhandle, active_window, XCB_CW_EVENT_MASK, values);
+			active_window = window;
+			values[0] = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+			if (active_window != XCB_NONE) xcb_change_window_attributes(conhandle, active_window, XCB_CW_EVENT_MASK, values);
+			debugf("Active window is now %u\n", active_window);
+		}
+		if (active_window != XCB_NONE) query_overlay_position();
+	}
 
-	values[0] = get_colorpixel(0xA6, 0xE2, 0x2E);
-	foreground = newGC(con, XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES, values);
+	xcb_translate_coordinates_reply_t *position;
+	if (poll_reply(position_query_pending, position_query.sequence, &position)) {
+		if (position) {
+			overlay_x = position->dst_x;
+			overlay_y = position->dst_y;
+		}
+		free(position);
+	}
+}
 
-	values[0] = get_colorpixel(0xFF, 0x45, 0x35);
-	foreground_muted = newGC(con, XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES, values);
+void create_hidden_overlay()
+{
+	const auto conhandle = con->handle();
+	const uint32_t values[2] = {1, OVERLAY_EVENT_MASK};
+
+	subwin = xcb_generate_id(conhandle);
+	xcb_create_window(conhandle, (uint8_t)XCB_COPY_FROM_PARENT, subwin, con->screen()->root, (int16_t)20, (int16_t)20, win_width, win_height, (uint16_t)0, (uint16_t)XCB_WINDOW_CLASS_INPUT_OUTPUT, con->screen()->root_visual, XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK, values);
+	if (presenter) presenter->Select(subwin);
+	overlay_visible = false;
+	debugf("Created hidden overlay %u\n", subwin);
+}
 
-	values[0] = get_colorpixel(0x38, 0x38, 0x30);
-	background = newGC(con, XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES, values);
+void show_overlay()
+{
+	const auto conhandle = con->handle();
+	if (overlay_visible) return;
 
-	buffer = xcb_generate_id(conhandle);
-	xcb_create_pixmap_checked(conhandle, screen->root_depth, buffer, subwin, 1024, 1024);
+	// The focus query goes out before the overlay takes the focus, so its
+	// reply names the window to return to.
+	previous_focus = XCB_NONE;
+	focus_query = xcb_get_input_focus(conhandle);
+	focus_query_pending = true;
 
+	const uint32_t values[3] = {(uint32_t)overlay_x, (uint32_t)overlay_y, XCB_STACK_MODE_ABOVE};
+	xcb_configure_window(conhandle, subwin, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_STACK_MODE, values);
 	xcb_map_window(conhandle, subwin);
-
 	xcb_set_input_focus(conhandle, XCB_INPUT_FOCUS_POINTER_ROOT, subwin, XCB_CURRENT_TIME);
+	if (g_grab_keyboard) {
+		keyboard_grab = xcb_grab_keyboard(conhandle, 1, con->screen()->root, XCB_CURRENT_TIME, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+		keyboard_grab_pending = true;
+	} else {
+		con->grabKeysUnchecked(OVERLAY_KEYS);
+	}
 
-	const auto olo = (uint32_t)XCB_EVENT_MASK_PROPERTY_CHANGE;
-	xcb_change_window_attributes_checked(conhandle, screen->root, XCB_CW_EVENT_MASK, &olo);
+	overlay_visible = true;
+	debugf("Showing overlay at %d,%d\n", overlay_x, overlay_y);
+	invalidate();
+	draw();
+}
 
-	con.grabKey(0, XK_j);
-	con.grabKey(0, XK_k);
-	con.grabKey(0, XK_q);
-	con.grabKey(0, XK_m);
-	con.grabKey(0, XK_Escape);
+void hide_overlay()
+{
+	const auto conhandle = con->handle();
+	if (!overlay_visible) return;
+
+	// A reply that is still outstanding is no longer of any use.
+	collect_overlay_replies();
+	if (focus_query_pending) {
+		xcb_discard_reply(conhandle, focus_query.sequence);
+		focus_query_pending = false;
+	}
+	if (keyboard_grab_pending) {
+		xcb_discard_reply(conhandle, keyboard_grab.sequence);
+		keyboard_grab_pending = false;
+	}
 
+	overlay_visible = false;
+	xcb_unmap_window(conhandle, subwin);
+	con->ungrabKeys();
+	// The previous window may be gone by now; that error only ends up in
+	// the event loop's log.
+	if (previous_focus != XCB_NONE) {
+		xcb_set_input_focus(conhandle, XCB_INPUT_FOCUS_POINTER_ROOT, previous_focus, XCB_CURRENT_TIME);
+	}
 	xcb_flush(conhandle);
+	debugf("Overlay hidden\n");
+}
 
-	defaults = pulsecl.GetDefaults();
-	opt_device = defaults.GetDefault(DeviceType::SINK).c_str();
-	device = pulsecl.GetDevice(opt_device, DeviceType::SINK);
-
-	if (!device) {
-		debugf("Failed to get default device\n");
-		throw std::runtime_error("No pulseaudio device");
+// The user is done with the overlay.
+void dismiss()
+{
+	if (g_daemon) {
+		hide_overlay();
+	} else {
+		reactor.Stop();
 	}
+}
 
-	vol = device->Volume();
-	muted = device->Muted();
+// SIGUSR1 shows the daemon's overlay; SIGINT and SIGTERM end it cleanly
+// so pending volume writes are still sent.
+void watch_signals(const sigset_t &mask)
+{
+	int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) throw std::runtime_error(std::string("signalfd: ") + strerror(errno));
+
+	reactor.AddFd(fd, [fd]() {
+		struct signalfd_siginfo info;
+		while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+			if (info.ssi_signo == SIGUSR1) {
+				show_overlay();
+			} else {
+				debugf("Received signal %u. Exiting.\n", info.ssi_signo);
+				reactor.Stop();
+			}
+		}
+	});
+}
 
-	// Replace original draw() with wait_for_valid_window_size_and_draw()
-	wait_for_valid_window_size_and_draw();
+// Net effect of a batch of input events. Key handlers only record what
+// they want changed; the batch is applied once after the X queue was
+// drained, so a burst costs one pulse write and one redraw.
+struct InputBatch
+{
+	int volume;
+	bool toggle_mute = false;
+	bool redraw = false;
+};
 
-	xcb_generic_event_t *ev;
+// Handles a single X event; the caller owns and frees it.
+void handle_event(xcb_generic_event_t *ev, InputBatch &batch)
+{
+	const auto conhandle = con->handle();
 	std::string logEvent = "";
-	while ((ev = xcb_wait_for_event(conhandle))) {
 
-		{  // log event
-			logEvent = "[";
-			if (auto evName = xcb_event_get_label(ev->response_type); evName != NULL)
-				logEvent += std::string(evName);
-			else
-				logEvent += "UNKNOWN-EVENT";
-			logEvent += "]\n";
+	if ((software && software->HandleEvent(ev)) || (presenter && presenter->HandleEvent(ev))) {
+		if (frame_pending) {
+			frame_pending = false;
+			batch.redraw = true;
 		}
+		return;
+	}
 
-		switch (ev->response_type & ~0x80) {
-			case 0:  // Error
-				{
-					auto err = (xcb_generic_error_t *)ev;
-					debugf("XCB ERROR: error_code=%u, sequence=%u, resource_id=%u, minor_code=%u, major_code=%u\n", err->error_code, err->sequence, err->resource_id, err->minor_code, err->major_code);
-
-					switch (err->error_code) {
-						case XCB_WINDOW: debugf("XCB error: BadWindow (invalid window parameter)\n"); break;
-						case XCB_MATCH: debugf("XCB error: BadMatch (parameter mismatch)\n"); break;
-						case XCB_DRAWABLE:
-							debugf("XCB error: BadDrawable (invalid drawable parameter)\n");
-							break;
-						default: break;
-					}
-					free(ev);
-					continue;
-					break;
+	{  // log event
+		logEvent = "[";
+		if (auto evName = xcb_event_get_label(ev->response_type); evName != NULL)
+			logEvent += std::string(evName);
+		else
+			logEvent += "UNKNOWN-EVENT";
+		logEvent += "]\n";
+	}
+
+	switch (ev->response_type & ~0x80) {
+		case 0:  // Error
+			{
+				auto err = (xcb_generic_error_t *)ev;
+				debugf("XCB ERROR: error_code=%u, sequence=%u, resource_id=%u, minor_code=%u, major_code=%u\n", err->error_code, err->sequence, err->resource_id, err->minor_code, err->major_code);
+
+				switch (err->error_code) {
+					case XCB_WINDOW: debugf("XCB error: BadWindow (invalid window parameter)\n"); break;
+					case XCB_MATCH: debugf("XCB error: BadMatch (parameter mismatch)\n"); break;
+					case XCB_DRAWABLE:
+						debugf("XCB error: BadDrawable (invalid drawable parameter)\n");
+						break;
+					default: break;
 				}
-			case XCB_EXPOSE:
-				{
-					auto e = (xcb_expose_event_t *)(ev);
+				return;
+			}
+		case XCB_EXPOSE:
+			{
+				auto e = (xcb_expose_event_t *)(ev);
+				if (software) {
+					if (!software->Expose(subwin, foreground, e->x, e->y, e->width, e->height)) batch.redraw = true;
+				} else {
 					xcb_copy_area(conhandle, buffer, subwin, foreground, e->x, e->y, e->x, e->y, e->width, e->height);
-					xcb_flush(conhandle);
-					debugf("XCB_EXPOSE\n");
-					break;
 				}
-			case XCB_FOCUS_IN:
+				xcb_flush(conhandle);
+				debugf("XCB_EXPOSE\n");
+				break;
+			}
+		case XCB_FOCUS_IN:
+			break;
+		case XCB_FOCUS_OUT:
+			{
+				// Focus leaving the overlay is reported directly, so no reply
+				// from the server is needed to decide whether to exit. Grab
+				// and ungrab transitions come from key grabs and do not mean
+				// another window was activated.
+				auto e = (xcb_focus_out_event_t *)(ev);
+				if (e->event == subwin
+					&& (e->mode == XCB_NOTIFY_MODE_NORMAL || e->mode == XCB_NOTIFY_MODE_WHILE_GRABBED)
+					&& e->detail != XCB_NOTIFY_DETAIL_INFERIOR && e->detail != XCB_NOTIFY_DETAIL_POINTER) {
+					debugf("Focus was moved AWAY from our overlay. Dismissing.\n");
+					dismiss();
+					return;
+				}
 				break;
-			case XCB_FOCUS_OUT:
+			}
+		case XCB_PROPERTY_NOTIFY:
+			{
+				auto e = (xcb_property_notify_event_t *)(ev);
+				if (g_daemon && e->window == con->screen()->root && e->atom == con->atom(Atom::NET_ACTIVE_WINDOW)) {
+					query_active_window();
+				}
 				break;
-			case XCB_PROPERTY_NOTIFY:
-				{
-					auto e = (xcb_property_notify_event_t *)(ev);
-					if (e->atom == con.readAtom("_NET_ACTIVE_WINDOW")) {
-						xcb_get_input_focus_cookie_t cookie = xcb_get_input_focus(con.handle());
-						xcb_get_input_focus_reply_t *reply = xcb_get_input_focus_reply(con.handle(), cookie, NULL);
-						if (reply && reply->focus != subwin) {
-							debugf("Active Window was changed AWAY from our overlay. Exiting.\n");
-							free(reply);
-							goto exit;
+			}
+		case XCB_KEY_PRESS:
+			{
+				logEvent = "";
+				auto e = (xcb_key_press_event_t *)(ev);
+
+				bool shift_pressed = e->state & XCB_MOD_MASK_SHIFT;
+				bool ctrl_pressed = e->state & XCB_MOD_MASK_CONTROL;
+				bool alt_pressed = e->state & XCB_MOD_MASK_1;
+				bool super_pressed = e->state & XCB_MOD_MASK_4;
+
+				const auto keysym = xcb_key_press_lookup_keysym(con->symbols(), e, 0);
+
+				debugf("KEY_PRESS: keysym=%d [%d:%d:%d:%d]\n", keysym, shift_pressed, ctrl_pressed, alt_pressed, super_pressed);
+
+				switch (keysym) {
+					case 106:  // j or J
+						if (batch.volume > 0) {
+							batch.volume -= 1;
 						}
-						free(reply);
 						break;
-					}
+					case 107:  // k or K
+						if (batch.volume < MAX_VOL) {
+							batch.volume += 1;
+						}
+						break;
+					case 109:  // m or M
+						batch.toggle_mute = !batch.toggle_mute;
+						break;
+					case 113:        // q
+					case XK_Escape:  // Escape
+						dismiss();
+						return;
+					case 99:   // c or C
+					case 100:  // d or D
+						if (ctrl_pressed) {
+							dismiss();
+							return;
+						}
+						break;
+				}
+				break;
+			}
+		case XCB_KEY_RELEASE:
+			logEvent = "";
+			break;
+		case XCB_BUTTON_PRESS:
+			batch.volume = std::min(batch.volume + 1, MAX_VOL);
+			break;
+		case XCB_MAP_NOTIFY:
+			debugf("XCB_MAP_NOTIFY received (window mapped)\n");
+			// A resize usually follows the map immediately.
+			if (awaiting_first_frame && ((xcb_map_notify_event_t *)ev)->window == subwin) {
+				reactor.ArmTimer(first_frame_timer, FIRST_FRAME_SETTLE);
+			}
+			break;
+		case XCB_DESTROY_NOTIFY:
+			if (((xcb_destroy_notify_event_t *)ev)->window == subwin) {
+				if (g_daemon) {
+					// The back buffer does not depend on the window.
+					debugf("Overlay window was destroyed. Recreating it.\n");
+					con->ungrabKeys();
+					create_hidden_overlay();
+					return;
+				}
+				debugf("Overlay window was destroyed. Exiting.\n");
+				free_buffer();
+				reactor.Stop();
+				return;
+			}
+			break;
+		case XCB_CONFIGURE_NOTIFY:
+			{
+				auto e = (xcb_configure_notify_event_t *)(ev);
+				if (g_daemon && e->window == active_window && active_window != XCB_NONE) {
+					query_overlay_position();
 					break;
 				}
-			case XCB_KEY_PRESS:
-				{
-					logEvent = "";
-					auto e = (xcb_key_press_event_t *)(ev);
-
-					bool shift_pressed = e->state & XCB_MOD_MASK_SHIFT;
-					bool ctrl_pressed = e->state & XCB_MOD_MASK_CONTROL;
-					bool alt_pressed = e->state & XCB_MOD_MASK_1;
-					bool super_pressed = e->state & XCB_MOD_MASK_4;
-
-					const auto keysym = xcb_key_press_lookup_keysym(con.symbols(), e, 0);
-
-					debugf("KEY_PRESS: keysym=%d [%d:%d:%d:%d]\n", keysym, shift_pressed, ctrl_pressed, alt_pressed, super_pressed);
-
-					switch (keysym) {
-						case 106:  // j or J
-							if (vol > 0) {
-								vol -= 1;
-								pulsecl.SetVolume(*device, vol);
-								draw();
-							}
-							break;
-						case 107:  // k or K
-							if (vol < MAX_VOL) {
-								vol += 1;
-								pulsecl.SetVolume(*device, vol);
-								draw();
-							}
-							break;
-						case 109:  // m or M
-							muted = !muted;
-							pulsecl.SetMute(*device, muted);
-							draw();
-							break;
-						case 113:        // q
-						case XK_Escape:  // Escape
-							goto exit;
-							break;
-						case 99:   // c or C
-						case 100:  // d or D
-							if (ctrl_pressed) {
-								goto exit;
-							}
-							break;
+				if (e->window == subwin && (e->width != win_width || e->height != win_height)) {
+					debugf("Window resized to %ux%u\n", e->width, e->height);
+					win_width = e->width;
+					win_height = e->height;
+					resize_buffer(win_width, win_height);
+					invalidate();
+					// The first frame draws at the new size by itself.
+					if (awaiting_first_frame) {
+						first_frame();
+					} else {
+						batch.redraw = true;
 					}
-					break;
 				}
-			case XCB_KEY_RELEASE:
-				logEvent = "";
-				break;
-			case XCB_BUTTON_PRESS:
-				vol += 1;
-				draw();
-				break;
-			case XCB_MAP_NOTIFY:
-				debugf("XCB_MAP_NOTIFY received (window mapped)\n");
 				break;
+			}
+
+		default:
+			logEvent = "";
+			debugf("unhandled(");
+			debugf("%d:", ev->response_type & ~0x80);
+			debugf("%d;", ev->response_type);
+			if (auto resptypeStr = xcb_event_get_label(ev->response_type); resptypeStr != NULL)
+				debugf(std::string(resptypeStr));
+			else
+				debugf("UNKNOWN-EVENT");
+			debugf(")\n");
+			debugf("Unhandled XCB event: type=0x%02x\n", ev->response_type & ~0x80);
+			break;
+	}
 
-			default:
-				logEvent = "";
-				debugf("unhandled(");
-				debugf("%d:", ev->response_type & ~0x80);
-				debugf("%d;", ev->response_type);
-				if (auto resptypeStr = xcb_event_get_label(ev->response_type); resptypeStr != NULL)
-					debugf(std::string(resptypeStr));
-				else
-					debugf("UNKNOWN-EVENT");
-				debugf(")\n");
-				debugf("Unhandled XCB event: type=0x%02x\n", ev->response_type & ~0x80);
-				break;
+	if (logEvent != "") {
+		debugf("Unhandled event: " + logEvent);
+	}
+}
+
+void apply_input(const InputBatch &batch)
+{
+	bool redraw = batch.redraw;
+
+	if (device && batch.volume != vol) {
+		vol = batch.volume;
+		mixer->QueueVolume(*device, vol);
+		redraw = true;
+	}
+	if (device && batch.toggle_mute) {
+		muted = !muted;
+		mixer->SetMute(*device, muted);
+		redraw = true;
+	}
+
+	if (redraw) frames.MarkDirty();
+}
+
+// Commands from paupctl act like the matching keys on the overlay.
+void handle_control(const paup_ctl_msg &msg)
+{
+	InputBatch batch = {vol};
+	switch (msg.cmd) {
+		case PAUP_CTL_SHOW:
+			show_overlay();
+			return;
+		case PAUP_CTL_VOLUME_ADJUST:
+			// Clamped first so a hostile arg cannot overflow the sum.
+			batch.volume = std::clamp(vol + std::clamp(msg.arg, -MAX_VOL, MAX_VOL), 0, MAX_VOL);
+			break;
+		case PAUP_CTL_VOLUME_SET:
+			batch.volume = std::clamp(msg.arg, 0, MAX_VOL);
+			break;
+		case PAUP_CTL_MUTE_TOGGLE:
+			batch.toggle_mute = true;
+			break;
+		case PAUP_CTL_MUTE_SET:
+			batch.toggle_mute = (msg.arg != 0) != muted;
+			break;
+		default:
+			debugf("Unknown control command %u\n", msg.cmd);
+			return;
+	}
+	apply_input(batch);
+}
+
+// Listens for paupctl on the socket from ctl.h. A socket left behind by a
+// daemon that died is replaced; one that still accepts datagrams is not.
+std::string control_path;
+
+void watch_control_socket()
+{
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (paup_ctl_socket_path(addr.sun_path, sizeof(addr.sun_path)) < 0) throw std::runtime_error("Control socket path too long");
+	if (paup_ctl_socket_check(addr.sun_path) < 0) throw std::runtime_error(std::string("Refusing control socket ") + addr.sun_path + ": " + strerror(errno));
+
+	int probe = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	bool taken = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	if (probe >= 0) close(probe);
+	if (taken) throw std::runtime_error(std::string("Another daemon is listening on ") + addr.sun_path);
+	unlink(addr.sun_path);
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) throw std::runtime_error(std::string("socket: ") + strerror(errno));
+	// Only our user may send commands.
+	mode_t mask = umask(0077);
+	int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (bound < 0) {
+		close(fd);
+		throw std::runtime_error(std::string("bind ") + addr.sun_path + ": " + strerror(errno));
+	}
+	control_path = addr.sun_path;
+
+	reactor.AddFd(fd, [fd]() {
+		paup_ctl_msg msg;
+		ssize_t n;
+		while ((n = recv(fd, &msg, sizeof(msg), 0)) >= 0) {
+			if (n != sizeof(msg) || msg.magic != PAUP_CTL_MAGIC || msg.version != PAUP_CTL_VERSION) {
+				debugf("Ignoring malformed control message (%zd bytes)\n", n);
+				continue;
+			}
+			handle_control(msg);
+		}
+	});
+	debugf("Listening for paupctl on %s\n", control_path.c_str());
+}
+
+// Handles every X event that can be read without blocking as one batch.
+// Only the first poll reads from the socket; the rest of the batch is
+// what that read already queued.
+void drain_x_events()
+{
+	const auto conhandle = con->handle();
+	InputBatch batch = {vol};
+	int count = 0;
+
+	xcb_generic_event_t *ev = xcb_poll_for_event(conhandle);
+	while (ev) {
+		{
+			const char *label = xcb_event_get_label(ev->response_type);
+			trace::Span span(label ? label : "UNKNOWN-EVENT", "x-event");
+			handle_event(ev, batch);
+		}
+		free(ev);
+		count++;
+		if (!reactor.Running()) break;
+		ev = xcb_poll_for_queued_event(conhandle);
+	}
+
+	if (count > 1) debugf("Handled %d events in one batch\n", count);
+	apply_input(batch);
+	if (g_daemon) collect_overlay_replies();
+
+	if (xcb_connection_has_error(conhandle)) {
+		debugf("X connection lost\n");
+		reactor.Stop();
+	}
+}
+
+// Run both populate modes against the live daemon and report how much
+// startup time the pipelined mode saves.
+void bench_populate(int runs)
+{
+	using clock = std::chrono::steady_clock;
+	const Mixer::PopulateMode modes[2] = {Mixer::PopulateMode::SERIAL, Mixer::PopulateMode::PIPELINED};
+	double total_ms[2] = {0.0, 0.0};
+
+	for (int i = 0; i < runs; ++i) {
+		for (int m = 0; m < 2; ++m) {
+			auto start = clock::now();
+			mixer->Populate(modes[m]);
+			total_ms[m] += std::chrono::duration<double, std::milli>(clock::now() - start).count();
+		}
+	}
+
+	double serial = total_ms[0] / runs, pipelined = total_ms[1] / runs;
+	printf("populate x%d\n", runs);
+	printf("  serial:    %8.3f ms\n", serial);
+	printf("  pipelined: %8.3f ms\n", pipelined);
+	printf("  saved:     %8.3f ms (%.1f%%)\n", serial - pipelined, serial > 0 ? 100.0 * (serial - pipelined) / serial : 0.0);
+}
+
+// Parses the value of a numeric flag, which must lie in [min, max].
+long parse_flag(const char *flag, const char *value, long min, long max)
+{
+	char *end;
+	errno = 0;
+	long n = strtol(value, &end, 10);
+	if (errno || end == value || *end || n < min || n > max) {
+		throw std::invalid_argument(std::string("invalid ") + flag + ": " + value);
+	}
+	return n;
+}
+
+void init(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
+			g_debug = true;
+		} else if (strcmp(argv[i], "--full-populate") == 0) {
+			g_full_populate = true;
+		} else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+			g_fps = parse_flag("--fps", argv[++i], 1, 1000);
+		} else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+			const char *renderer = argv[++i];
+			if (strcmp(renderer, "software") != 0 && strcmp(renderer, "core") != 0) {
+				throw std::invalid_argument(std::string("unknown renderer: ") + renderer);
+			}
+			g_software_render = strcmp(renderer, "software") == 0;
+		} else if (strcmp(argv[i], "--daemon") == 0) {
+			g_daemon = true;
+		} else if (strcmp(argv[i], "--present") == 0) {
+			g_present = true;
+		} else if (strcmp(argv[i], "--grab-keyboard") == 0) {
+			g_grab_keyboard = true;
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			trace::Start(argv[++i]);
+		} else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+			const char *backend = argv[++i];
+			if (strcmp(backend, "fake") != 0 && strcmp(backend, "pulse") != 0) {
+				throw std::invalid_argument(std::string("unknown backend: ") + backend);
+			}
+			g_fake_backend = strcmp(backend, "fake") == 0;
+		} else if (strcmp(argv[i], "--fake-latency") == 0 && i + 1 < argc) {
+			g_fake_latency = std::chrono::microseconds(parse_flag("--fake-latency", argv[++i], 0, LONG_MAX));
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			stats::Enable();
+		} else if (strcmp(argv[i], "--bench") == 0) {
+			g_bench = true;
+		} else if (strcmp(argv[i], "--bench-populate") == 0 && i + 1 < argc) {
+			g_bench_populate = parse_flag("--bench-populate", argv[++i], 1, INT_MAX);
 		}
+	}
+
+	if (g_bench_populate > 0) {
+		mixer = std::make_unique<PulseClient>("paup");
+		bench_populate(g_bench_populate);
+		return;
+	}
+
+	// The signals are blocked before the pulse thread starts, so it inherits
+	// the mask and they are only ever read from the signalfd. Recording
+	// runs also end cleanly on SIGINT so the trace and stats are written.
+	sigset_t signals;
+	sigemptyset(&signals);
+	const bool watch_exit_signals = g_daemon || trace::Enabled() || stats::Enabled();
+	if (g_daemon) sigaddset(&signals, SIGUSR1);
+	if (watch_exit_signals) {
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+	}
 
-		if (logEvent != "") {
-			debugf("Unhandled event: " + logEvent);
+	// The pulse handshake and introspection do not depend on X at all, so
+	// run them while the window, GCs and pixmap are being set up. The
+	// first frame is gated on whichever side finishes last.
+	stats::SetPhase("x-setup");
+	trace::SetThreadName("main");
+	auto pulse_ready = std::async(std::launch::async, []() {
+		stats::SetPhase("pulse-setup");
+		trace::SetThreadName("pulse-setup");
+		trace::Span span("init mixer", "init");
+		auto start = bench_clock::now();
+		std::unique_ptr<Mixer> client;
+		if (g_fake_backend) {
+			client = std::make_unique<FakeMixer>(reactor, g_fake_latency);
+		} else {
+			client = std::make_unique<PulseClient>("paup");
 		}
-		if (ev != NULL) {
-			free(ev);
+		// Subscribe first so nothing that changes during the initial
+		// queries is missed.
+		client->Subscribe();
+		record_phase(Phase::PULSE_CONNECT, start);
+		start = bench_clock::now();
+		// Only the default sink is needed to show the overlay; everything
+		// else is fetched lazily if it is ever asked for.
+		if (g_full_populate) {
+			client->Populate();
+		} else {
+			client->PopulateDefault(DeviceType::SINK);
 		}
+		record_phase(Phase::POPULATE, start);
+		debugf("Populate took %.3f ms\n", phase_ms[static_cast<size_t>(Phase::POPULATE)]);
+		return client;
+	});
+
+	auto phase_start = bench_clock::now();
+	{
+		trace::Span span("init con", "init");
+		con = std::make_unique<Connection>();
 	}
+	auto screen = con->screen();
+	auto conhandle = con->handle();
+	record_phase(Phase::X_CONNECT, phase_start);
+
+	phase_start = bench_clock::now();
+	if (g_daemon) {
+		con->internAtoms();
+		create_hidden_overlay();
+		track_active_window();
+	} else {
+		auto getwin = xcb_get_input_focus(conhandle);
+		auto rep = stats::Blocking("xcb_get_input_focus_reply", [&] { return xcb_get_input_focus_reply(conhandle, getwin, NULL); });
+		if (!rep) {
+			debugf("xcb_get_input_focus_reply failed\n");
+			throw std::runtime_error("Failed to get input focus");
+		}
+		auto parent = rep->focus;
+		free(rep);
+
+		uint32_t windowmask = OVERLAY_EVENT_MASK;
+
+		xcb_window_t overlay_parent = parent;
+		xcb_window_t window_id = xcb_generate_id(conhandle);
+
+		auto create = xcb_create_window_checked(conhandle, (uint8_t)XCB_COPY_FROM_PARENT, window_id, overlay_parent, (int16_t)20, (int16_t)20, DEFAULT_WIDTH, DEFAULT_HEIGHT, (uint16_t)0, (uint16_t)XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, XCB_CW_EVENT_MASK, &windowmask);
+		xcb_generic_error_t *err = stats::Blocking("xcb_request_check", [&] { return xcb_request_check(conhandle, create); });
+		used_fallback = false;
+		if (err) {
+			debugf("Window creation failed with parent (focus): error_code=%d (falling back to root)\n", err->error_code);
+			free(err);
+
+			overlay_parent = screen->root;
+			window_id = xcb_generate_id(conhandle);
+			xcb_create_window(conhandle, (uint8_t)XCB_COPY_FROM_PARENT, window_id, overlay_parent, (int16_t)20, (int16_t)20, DEFAULT_WIDTH, DEFAULT_HEIGHT, (uint16_t)0, (uint16_t)XCB_WINDOW_CLASS_INPUT_OUTPUT, screen->root_visual, XCB_CW_EVENT_MASK, &windowmask);
+			used_fallback = true;
+		}
+		subwin = window_id;
+	}
+	record_phase(Phase::WINDOW, phase_start);
+
+	phase_start = bench_clock::now();
+	const Rgb bar_color = {0xA6, 0xE2, 0x2E}, muted_color = {0xFF, 0x45, 0x35}, background_color = {0x38, 0x38, 0x30};
+	auto const pixels = con->allocColors({bar_color, muted_color, background_color});
+
+	uint32_t values[2];
+	values[1] = 0;
+
+	values[0] = pixels[0];
+	foreground = newGC(*con, XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES, values);
+
+	values[0] = pixels[1];
+	foreground_muted = newGC(*con, XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES, values);
+
+	values[0] = pixels[2];
+	background = newGC(*con, XCB_GC_FOREGROUND | XCB_GC_GRAPHICS_EXPOSURES, values);
+
+	if (g_software_render) {
+		if (SoftwareRenderer::Supported(conhandle, screen, con->visual())) {
+			auto rgb = [](Rgb c) { return uint32_t(c.r) << 16 | uint32_t(c.g) << 8 | c.b; };
+			software = std::make_unique<SoftwareRenderer>(conhandle, screen);
+			software->SetColors(rgb(bar_color), rgb(muted_color), rgb(background_color));
+		} else {
+			debugf("Visual not supported by the software renderer, using core rendering\n");
+		}
+	}
+
+	resize_buffer(win_width, win_height);
+	record_phase(Phase::COLORS_GCS, phase_start);
+	if (software) debugf("Software rendering %s MIT-SHM\n", software->UsingShm() ? "with" : "without");
+
+	// Present paces the core renderer's back buffer; the software renderer
+	// is paced by its own SHM completion events.
+	if (g_present && !software) {
+		presenter = std::make_unique<Presenter>(conhandle);
+		if (presenter->Available()) {
+			presenter->Select(subwin);
+		} else {
+			debugf("Present extension not available, copying frames directly\n");
+			presenter.reset();
+		}
+	}
+
+	if (!g_daemon) {
+		xcb_map_window(conhandle, subwin);
+		xcb_set_input_focus(conhandle, XCB_INPUT_FOCUS_POINTER_ROOT, subwin, XCB_CURRENT_TIME);
+		grab_overlay_keys();
+		overlay_visible = true;
+	}
+
+	xcb_flush(conhandle);
+
+	mixer = pulse_ready.get();
+	debugf("X and pulse setup complete\n");
+
+	defaults = mixer->GetDefaults();
+	opt_device = defaults.GetDefault(DeviceType::SINK).c_str();
+	device = mixer->GetDevice(opt_device, DeviceType::SINK);
+
+	if (!device) {
+		debugf("Failed to get default device\n");
+		throw std::runtime_error("No pulseaudio device");
+	}
+
+	device_index = device->Index();
+	vol = device->Volume();
+	muted = device->Muted();
+
+	mixer->SetChangeCallback(on_mixer_change);
+	// Nothing is drawn before the first frame.
+	frames.Init(reactor, g_fps, []() {
+		if (overlay_visible && !awaiting_first_frame) draw();
+	});
+	if (watch_exit_signals) watch_signals(signals);
+	if (g_daemon) {
+		watch_control_socket();
+		debugf("Daemon ready, run paupctl or send SIGUSR1 to show the overlay\n");
+	} else {
+		schedule_first_frame();
+	}
+
+	// X input, pulse and timers all run from one loop: pulse's mainloop
+	// does the blocking wait and also wakes up for the reactor's fds.
+	reactor.AddFd(xcb_get_file_descriptor(conhandle), drain_x_events);
+	reactor.SetPrepareCallback([conhandle]() {
+		drain_x_events();
+		xcb_flush(conhandle);
+	});
+	mixer->SetWakeupFd(reactor.Fd());
+	reactor.SetWaiter([]() { mixer->Iterate(true); });
+
+	// The first frame may already be on screen.
+	stats::SetPhase("loop");
+	if (!first_frame_done) reactor.Run();
 
-exit:
 	debugf("Exiting main loop\n");
-	return;
+	stats::SetPhase("exit");
+	if (g_bench) print_phases();
+	if (!control_path.empty()) unlink(control_path.c_str());
+	free_buffer();
+	software.reset();
+	xcb_flush(conhandle);
+	stats::Blocking("Mixer::Drain", [] { mixer->Drain(); });
+
+	if (auto fake = dynamic_cast<FakeMixer *>(mixer.get())) {
+		fprintf(stderr, "fake backend: %lu writes, %lu coalesced\n", fake->GetCounters().writes, fake->GetCounters().coalesced);
+	}
 }
 
+// Writes the --stats summary and the --trace file however main() is left.
+struct ExitReport
+{
+	~ExitReport()
+	{
+		if (stats::Enabled()) stats::Summary(stderr);
+		if (trace::Enabled() && !trace::Write()) fprintf(stderr, "failed to write trace: %s\n", strerror(errno));
+	}
+};
+
 int main(int argc, char **argv)
 {
+	ExitReport report;
 	try {
 		init(argc, argv);
-		exit(0);
+	} catch (std::invalid_argument const &ex) {
+		// A bad command line is the user's to fix, so it is always shown.
+		fprintf(stderr, "paup: %s\n", ex.what());
+		return 2;
 	} catch (std::exception const &ex) {
 		debugf("[EXCEPTION]\n");
 		debugf(std::string(ex.what()) + "\n");
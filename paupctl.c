@@ -0,0 +1,75 @@
+// paupctl sends a single command to a running `paup --daemon` over the
+// control socket described in ctl.h. It links nothing but libc, so hotkey
+// daemons can fire it without opening an X or pulse connection.
+
+#include "ctl.h"
+
+// C
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int usage(void)
+{
+	fprintf(stderr,
+		"usage: paupctl show\n"
+		"       paupctl volume [+|-]PERCENT\n"
+		"       paupctl mute [toggle|on|off]\n");
+	return 2;
+}
+
+static int parse_int(const char *s, int32_t *out)
+{
+	char *end;
+	errno = 0;
+	long v = strtol(s, &end, 10);
+	if (errno || end == s || *end || v < INT32_MIN || v > INT32_MAX) return -1;
+	*out = (int32_t)v;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct paup_ctl_msg msg = {PAUP_CTL_MAGIC, PAUP_CTL_VERSION, 0, 0};
+
+	if (argc == 2 && strcmp(argv[1], "show") == 0) {
+		msg.cmd = PAUP_CTL_SHOW;
+	} else if (argc == 3 && strcmp(argv[1], "volume") == 0) {
+		// A sign makes the change relative.
+		msg.cmd = (argv[2][0] == '+' || argv[2][0] == '-') ? PAUP_CTL_VOLUME_ADJUST : PAUP_CTL_VOLUME_SET;
+		if (parse_int(argv[2], &msg.arg) < 0) return usage();
+	} else if ((argc == 2 || argc == 3) && strcmp(argv[1], "mute") == 0) {
+		if (argc == 2 || strcmp(argv[2], "toggle") == 0) {
+			msg.cmd = PAUP_CTL_MUTE_TOGGLE;
+		} else if (strcmp(argv[2], "on") == 0 || strcmp(argv[2], "off") == 0) {
+			msg.cmd = PAUP_CTL_MUTE_SET;
+			msg.arg = strcmp(argv[2], "on") == 0;
+		} else {
+			return usage();
+		}
+	} else {
+		return usage();
+	}
+
+	struct sockaddr_un addr = {0};
+	addr.sun_family = AF_UNIX;
+	if (paup_ctl_socket_path(addr.sun_path, sizeof(addr.sun_path)) < 0) {
+		fprintf(stderr, "paupctl: control socket path too long\n");
+		return 1;
+	}
+	if (paup_ctl_socket_check(addr.sun_path) < 0) {
+		fprintf(stderr, "paupctl: refusing %s: %s\n", addr.sun_path, strerror(errno));
+		return 1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || sendto(fd, &msg, sizeof(msg), 0, (struct sockaddr *)&addr, sizeof(addr)) != sizeof(msg)) {
+		fprintf(stderr, "paupctl: %s: %s\n", addr.sun_path, strerror(errno));
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,66 @@
+// Self
+#include "pixels.h"
+
+// C
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace pixels
+{
+void FillSpan(uint32_t *dst, uint32_t color, size_t n)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i c = _mm_set1_epi32(color);
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), c);
+	}
+#endif
+	for (; i < n; ++i) {
+		dst[i] = color;
+	}
+}
+
+void BlendSpan(uint32_t *dst, uint32_t color, uint16_t alpha, size_t n)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i a = _mm_set1_epi16(alpha);
+	const __m128i ia = _mm_set1_epi16(256 - alpha);
+	// Two pixels of the source colour widened to 16 bit channels,
+	// premultiplied by the coverage.
+	const __m128i src = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_set1_epi32(color), zero), a);
+	for (; i + 4 <= n; i += 4) {
+		__m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + i));
+		__m128i lo = _mm_unpacklo_epi8(d, zero);
+		__m128i hi = _mm_unpackhi_epi8(d, zero);
+		lo = _mm_srli_epi16(_mm_add_epi16(src, _mm_mullo_epi16(lo, ia)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(src, _mm_mullo_epi16(hi, ia)), 8);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < n; ++i) {
+		uint32_t out = 0;
+		for (int shift = 0; shift < 32; shift += 8) {
+			uint32_t s = (color >> shift) & 0xFF, d = (dst[i] >> shift) & 0xFF;
+			out |= ((s * alpha + d * (256 - alpha)) >> 8) << shift;
+		}
+		dst[i] = out;
+	}
+}
+
+uint32_t Lighten(uint32_t a, uint32_t t)
+{
+	uint32_t out = 0;
+	for (int shift = 0; shift < 24; shift += 8) {
+		uint32_t c = (a >> shift) & 0xFF;
+		out |= (c + (((0xFF - c) * t) >> 8)) << shift;
+	}
+	return out;
+}
+
+}  // namespace pixels
+
+// vim: set et ts=2 sw=2:
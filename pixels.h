@@ -0,0 +1,24 @@
+#pragma once
+
+// C
+#include <stddef.h>
+#include <stdint.h>
+
+// Span kernels of the software renderer on 32 bit XRGB pixels. They use
+// SSE2 where the compiler targets it and plain C for the remainder, and
+// both paths produce the same pixels.
+namespace pixels
+{
+// Fills n pixels with a solid colour.
+void FillSpan(uint32_t *dst, uint32_t color, size_t n);
+
+// Blends a colour over n pixels with the given coverage (0-256):
+// dst = (color * alpha + dst * (256 - alpha)) / 256 per channel.
+void BlendSpan(uint32_t *dst, uint32_t color, uint16_t alpha, size_t n);
+
+// Mixes a towards white by t/256.
+uint32_t Lighten(uint32_t a, uint32_t t);
+
+}  // namespace pixels
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,58 @@
+// Self
+#include "present.h"
+
+#include "stats.h"
+
+// C
+#include <stdlib.h>
+
+Presenter::Presenter(xcb_connection_t *connection)
+	: connection_(connection)
+{
+	const xcb_query_extension_reply_t *ext = stats::Blocking("xcb_get_extension_data", [this] { return xcb_get_extension_data(connection_, &xcb_present_id); });
+	if (!ext || !ext->present) return;
+
+	auto cookie = xcb_present_query_version(connection_, 1, 0);
+	xcb_present_query_version_reply_t *version = stats::Blocking("xcb_present_query_version_reply", [&] { return xcb_present_query_version_reply(connection_, cookie, nullptr); });
+	if (!version) return;
+	free(version);
+
+	opcode_ = ext->major_opcode;
+	available_ = true;
+}
+
+void Presenter::Select(xcb_window_t window)
+{
+	// Frames queued for a previous window will not be reported anymore.
+	eid_ = xcb_generate_id(connection_);
+	complete_ = idle_ = true;
+	xcb_present_select_input(connection_, eid_, window, XCB_PRESENT_EVENT_MASK_COMPLETE_NOTIFY | XCB_PRESENT_EVENT_MASK_IDLE_NOTIFY);
+}
+
+void Presenter::Present(xcb_window_t window, xcb_pixmap_t pixmap)
+{
+	// A target msc of zero with no divisor means the next vertical blank.
+	// The whole pixmap is presented: the window is never larger than it and
+	// the copy is clipped to the window.
+	xcb_present_pixmap(connection_, window, pixmap, ++serial_, 0, 0, 0, 0, 0, 0, 0, XCB_PRESENT_OPTION_NONE, 0, 0, 0, 0, nullptr);
+	complete_ = idle_ = false;
+}
+
+bool Presenter::HandleEvent(const xcb_generic_event_t *ev)
+{
+	if (!available_ || (ev->response_type & ~0x80) != XCB_GE_GENERIC) return false;
+
+	auto e = reinterpret_cast<const xcb_present_complete_notify_event_t *>(ev);
+	if (e->extension != opcode_) return false;
+
+	// Events about an older frame do not free the pixmap for drawing.
+	if (e->event_type == XCB_PRESENT_COMPLETE_NOTIFY && e->kind == XCB_PRESENT_COMPLETE_KIND_PIXMAP && e->serial == serial_) {
+		complete_ = true;
+	} else if (e->event_type == XCB_PRESENT_IDLE_NOTIFY) {
+		auto idle = reinterpret_cast<const xcb_present_idle_notify_event_t *>(ev);
+		if (idle->serial == serial_) idle_ = true;
+	}
+	return true;
+}
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,54 @@
+#pragma once
+
+// C
+#include <stdint.h>
+
+// external
+#include <xcb/xcb.h>
+#include <xcb/present.h>
+
+// Presents a pixmap through the Present extension. Each frame is queued
+// for the next vertical blank, and the server reports with CompleteNotify
+// once it was shown. Drawing the next frame only after that paces the
+// overlay to the display's refresh rate instead of to the input rate.
+//
+// The same pixmap is presented every frame, so it is also only drawn to
+// again after IdleNotify: a flip may keep scanning it out after the
+// frame completed, and drawing into it then would tear.
+class Presenter
+{
+public:
+	// Queries the extension; check Available() before using anything else.
+	explicit Presenter(xcb_connection_t *connection);
+
+	Presenter(const Presenter &) = delete;
+	Presenter &operator=(const Presenter &) = delete;
+
+	bool Available() const { return available_; }
+
+	// Asks for completion and idle events of frames presented to this
+	// window. Call it again if the window is replaced.
+	void Select(xcb_window_t window);
+
+	// Queues the pixmap's contents for the window's next vertical blank.
+	void Present(xcb_window_t window, xcb_pixmap_t pixmap);
+
+	// A frame was queued and has not completed yet, or the server still
+	// holds the pixmap.
+	bool Busy() const { return !complete_ || !idle_; }
+
+	// Consumes Present events; returns whether ev was one.
+	bool HandleEvent(const xcb_generic_event_t *ev);
+
+private:
+	xcb_connection_t *connection_;
+	uint8_t opcode_ = 0;
+	bool available_ = false;
+
+	xcb_present_event_t eid_ = 0;
+	uint32_t serial_ = 0;
+	bool complete_ = true;
+	bool idle_ = true;
+};
+
+// vim: set et ts=2 sw=2:
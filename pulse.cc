@@ -1,6 +1,9 @@
 // Self
 #include "pulse.h"
 
+#include "stats.h"
+#include "trace.h"
+
 // C
 #include <err.h>
 #include <stdio.h>
@@ -41,20 +44,6 @@ void card_info_cb(pa_context *context, const pa_card_info *info, int eol, void *
 	}
 }
 
-template <typename T>
-void device_info_cb(pa_context *context, const T *info, int eol, void *raw)
-{
-	if (eol < 0) {
-		fprintf(stderr, "%s error in %s: \n", __func__, pa_strerror(pa_context_errno(context)));
-		return;
-	}
-
-	if (!eol) {
-		auto devices = static_cast<std::vector<Device> *>(raw);
-		devices->push_back(info);
-	}
-}
-
 void server_info_cb(pa_context *context __attribute__((unused)), const pa_server_info *i, void *raw)
 {
 	auto defaults = static_cast<ServerInfo *>(raw);
@@ -72,6 +61,81 @@ int volume_as_percent(const pa_cvolume *cvol)
 	return round(pa_cvolume_max(cvol) * 100.0 / PA_VOLUME_NORM);
 }
 
+Device make_device(DeviceType type, uint32_t index, const char *name, const char *desc, int mute, PulseDevice pulse)
+{
+	const int volume = volume_as_percent(&pulse.volume);
+	const int balance = pa_cvolume_get_balance(&pulse.volume, &pulse.channels) * 100.0;
+	return Device(type, index, name ? name : "", desc ? desc : "", volume, mute, balance, std::move(pulse));
+}
+
+Device make_device(const pa_sink_info *info)
+{
+	PulseDevice pulse;
+	pulse.volume = info->volume;
+	pulse.channels = info->channel_map;
+	pulse.card_idx = info->card;
+	pulse.ops = {pa_context_set_sink_mute_by_index, pa_context_set_sink_volume_by_index, pa_context_set_default_sink, nullptr, nullptr};
+
+	if (info->active_port) {
+		switch (info->active_port->available) {
+			case PA_PORT_AVAILABLE_YES:
+				pulse.available = PulseDevice::Availability::YES;
+				break;
+			case PA_PORT_AVAILABLE_NO:
+				pulse.available = PulseDevice::Availability::NO;
+				break;
+			case PA_PORT_AVAILABLE_UNKNOWN:
+				pulse.available = PulseDevice::Availability::UNKNOWN;
+				break;
+		}
+	}
+	return make_device(DeviceType::SINK, info->index, info->name, info->description, info->mute, pulse);
+}
+
+Device make_device(const pa_source_info *info)
+{
+	PulseDevice pulse;
+	pulse.volume = info->volume;
+	pulse.channels = info->channel_map;
+	pulse.card_idx = info->card;
+	pulse.ops = {pa_context_set_source_mute_by_index, pa_context_set_source_volume_by_index, pa_context_set_default_source, nullptr, nullptr};
+	return make_device(DeviceType::SOURCE, info->index, info->name, info->description, info->mute, pulse);
+}
+
+Device make_device(const pa_sink_input_info *info)
+{
+	PulseDevice pulse;
+	pulse.volume = info->volume;
+	pulse.channels = info->channel_map;
+	pulse.ops = {pa_context_set_sink_input_mute, pa_context_set_sink_input_volume, nullptr, pa_context_kill_sink_input, pa_context_move_sink_input_by_index};
+	const char *desc = pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME);
+	return make_device(DeviceType::SINK_INPUT, info->index, info->name, desc, info->mute, pulse);
+}
+
+Device make_device(const pa_source_output_info *info)
+{
+	PulseDevice pulse;
+	pulse.volume = info->volume;
+	pulse.channels = info->channel_map;
+	pulse.ops = {pa_context_set_source_output_mute, pa_context_set_source_output_volume, nullptr, pa_context_kill_source_output, pa_context_move_source_output_by_index};
+	const char *desc = pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME);
+	return make_device(DeviceType::SOURCE_OUTPUT, info->index, info->name, desc, info->mute, pulse);
+}
+
+template <typename T>
+void device_info_cb(pa_context *context, const T *info, int eol, void *raw)
+{
+	if (eol < 0) {
+		fprintf(stderr, "%s error in %s: \n", __func__, pa_strerror(pa_context_errno(context)));
+		return;
+	}
+
+	if (!eol) {
+		auto devices = static_cast<std::vector<Device> *>(raw);
+		devices->push_back(make_device(info));
+	}
+}
+
 int xstrtol(const char *str, long *out)
 {
 	char *end = nullptr;
@@ -108,9 +172,11 @@ PulseClient::PulseClient(std::string client_name)
 
 	pa_context_set_state_callback(context_, connect_state_cb, &state);
 	pa_context_connect(context_, nullptr, PA_CONTEXT_NOFLAGS, nullptr);
-	while (state != PA_CONTEXT_READY && state != PA_CONTEXT_FAILED) {
-		pa_mainloop_iterate(mainloop_, 1, nullptr);
-	}
+	stats::Blocking("pa_context_connect", [this, &state] {
+		while (state != PA_CONTEXT_READY && state != PA_CONTEXT_FAILED) {
+			pa_mainloop_iterate(mainloop_, 1, nullptr);
+		}
+	});
 
 	if (state != PA_CONTEXT_READY) {
 		fprintf(stderr, "failed to connect to pulse daemon: %s\n", pa_strerror(pa_context_errno(context_)));
@@ -127,16 +193,87 @@ PulseClient::~PulseClient()
 	pa_mainloop_free(mainloop_);
 }
 
-void PulseClient::Populate()
+void PulseClient::Populate(PopulateMode mode)
+{
+	trace::Span span("PulseClient::Populate", "pulse");
+
+	switch (mode) {
+		case PopulateMode::SERIAL:
+			populate_server_info();
+			populate_sinks();
+			populate_sources();
+			break;
+		case PopulateMode::PIPELINED:
+			populate_pipelined();
+			break;
+	}
+
+	for (bool &p : populated_) {
+		p = true;
+	}
+
+	cards_.clear();
+	cards_populated_ = false;
+}
+
+Device *PulseClient::PopulateDefault(DeviceType type)
+{
+	trace::Span span("PulseClient::PopulateDefault", "pulse");
+
+	ServerInfo defaults;
+	std::vector<Device> devices;
+
+	// The server info rides along with the device query, so both defaults
+	// are known for the cost of a single round trip.
+	switch (type) {
+		case DeviceType::SINK:
+			WaitOperationsComplete({
+				pa_context_get_server_info(context_, server_info_cb, &defaults),
+				pa_context_get_sink_info_by_name(context_, "@DEFAULT_SINK@", device_info_cb, static_cast<void *>(&devices)),
+			});
+			break;
+		case DeviceType::SOURCE:
+			WaitOperationsComplete({
+				pa_context_get_server_info(context_, server_info_cb, &defaults),
+				pa_context_get_source_info_by_name(context_, "@DEFAULT_SOURCE@", device_info_cb, static_cast<void *>(&devices)),
+			});
+			break;
+		default:
+			throw std::invalid_argument("only sinks and sources have a default");
+	}
+
+	sinks_.clear();
+	sources_.clear();
+	sink_inputs_.clear();
+	source_outputs_.clear();
+	cards_.clear();
+	cards_populated_ = false;
+	for (bool &p : populated_) {
+		p = false;
+	}
+
+	defaults_ = std::move(defaults);
+	if (devices.empty()) return nullptr;
+
+	// The device we got is the default even if the server info was lost.
+	if (type == DeviceType::SINK) {
+		defaults_.sink = devices.front().name_;
+	} else {
+		defaults_.source = devices.front().name_;
+	}
+	devices_of(type) = std::move(devices);
+	return &devices_of(type).front();
+}
+
+const std::vector<Card> &PulseClient::GetCards()
 {
-	populate_server_info();
-	populate_sinks();
-	populate_sources();
-	populate_cards();
+	if (!cards_populated_) populate_cards();
+	return cards_;
 }
 
 Card *PulseClient::GetCard(const uint32_t index)
 {
+	if (!cards_populated_) populate_cards();
 	for (Card &card : cards_) {
 		if (card.index_ == index) return &card;
 	}
@@ -149,14 +286,16 @@ Card *PulseClient::GetCard(const std::string &name)
 	if (xstrtol(name.c_str(), &val) == 0) {
 		return GetCard(val);
 	} else {
+		if (!cards_populated_) populate_cards();
 		return find_fuzzy(cards_, name);
 	}
 }
 
 Card *PulseClient::GetCard(const Device &device)
 {
+	if (!cards_populated_) populate_cards();
 	for (Card &card : cards_) {
-		if (device.card_idx_ == card.index_) return &card;
+		if (pulse_of(device).card_idx == card.index_) return &card;
 	}
 	return nullptr;
 }
@@ -211,72 +350,112 @@ Device *PulseClient::GetDevice(const std::string &name, DeviceType type)
 	throw unreachable();
 }
 
-const std::vector<Device> &PulseClient::GetDevices(DeviceType type) const
+const std::vector<Device> &PulseClient::GetDevices(DeviceType type)
+{
+	if (!populated(type)) populate_devices(type);
+	return devices_of(type);
+}
+
+std::vector<Device> &PulseClient::devices_of(DeviceType type)
 {
 	switch (type) {
 		case DeviceType::SINK:
-			return GetSinks();
+			return sinks_;
 		case DeviceType::SOURCE:
-			return GetSources();
+			return sources_;
 		case DeviceType::SINK_INPUT:
-			return GetSinkInputs();
+			return sink_inputs_;
 		case DeviceType::SOURCE_OUTPUT:
-			return GetSourceOutputs();
+			return source_outputs_;
 	}
 
 	throw unreachable();
 }
 
+template <typename Key>
+Device *PulseClient::find_device(DeviceType type, const Key &key)
+{
+	Device *device = get_device(devices_of(type), key);
+	if (!device && !populated(type)) {
+		populate_devices(type);
+		device = get_device(devices_of(type), key);
+	}
+	return device;
+}
+
 Device *PulseClient::GetSink(const uint32_t index)
 {
-	return get_device(sinks_, index);
+	return find_device(DeviceType::SINK, index);
 }
 
 Device *PulseClient::GetSink(const std::string &name)
 {
-	return get_device(sinks_, name);
+	return find_device(DeviceType::SINK, name);
 }
 
 Device *PulseClient::GetSource(const uint32_t index)
 {
-	return get_device(sources_, index);
+	return find_device(DeviceType::SOURCE, index);
 }
 
 Device *PulseClient::GetSource(const std::string &name)
 {
-	return get_device(sources_, name);
+	return find_device(DeviceType::SOURCE, name);
 }
 
 Device *PulseClient::GetSinkInput(const uint32_t index)
 {
-	return get_device(sink_inputs_, index);
+	return find_device(DeviceType::SINK_INPUT, index);
 }
 
 Device *PulseClient::GetSinkInput(const std::string &name)
 {
-	return get_device(sink_inputs_, name);
+	return find_device(DeviceType::SINK_INPUT, name);
 }
 
 Device *PulseClient::GetSourceOutput(const uint32_t index)
 {
-	return get_device(source_outputs_, index);
+	return find_device(DeviceType::SOURCE_OUTPUT, index);
 }
 
 Device *PulseClient::GetSourceOutput(const std::string &name)
 {
-	return get_device(source_outputs_, name);
+	return find_device(DeviceType::SOURCE_OUTPUT, name);
 }
 
 void PulseClient::WaitOperationComplete(pa_operation *op)
 {
-	int r;
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
-		pa_mainloop_iterate(mainloop_, 1, &r);
-	}
+	stats::Blocking("WaitOperationComplete", [this, op] {
+		int r;
+		while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
+			pa_mainloop_iterate(mainloop_, 1, &r);
+		}
+	});
 
 	pa_operation_unref(op);
 }
 
+void PulseClient::WaitOperationsComplete(std::initializer_list<pa_operation *> ops)
+{
+	auto running = [&ops]() {
+		for (pa_operation *op : ops) {
+			if (op && pa_operation_get_state(op) == PA_OPERATION_RUNNING) return true;
+		}
+		return false;
+	};
+
+	stats::Blocking("WaitOperationsComplete", [this, &running] {
+		int r;
+		while (running()) {
+			pa_mainloop_iterate(mainloop_, 1, &r);
+		}
+	});
+
+	for (pa_operation *op : ops) {
+		if (op) pa_operation_unref(op);
+	}
+}
+
 template <class T>
 T *PulseClient::find_fuzzy(std::vector<T> &haystack, const std::string &needle)
 {
@@ -299,11 +478,14 @@ T *PulseClient::find_fuzzy(std::vector<T> &haystack, const std::string &needle)
 
 void PulseClient::populate_cards()
 {
+	trace::Span span("PulseClient::populate_cards", "pulse");
+
 	std::vector<Card> cards;
 	WaitOperationComplete(pa_context_get_card_info_list(
 		context_, card_info_cb, static_cast<void *>(&cards)));
 
 	cards_ = std::move(cards);
+	cards_populated_ = true;
 }
 
 void PulseClient::populate_server_info()
@@ -338,16 +520,74 @@ void PulseClient::populate_sources()
 	source_outputs_ = std::move(source_outputs);
 }
 
+void PulseClient::populate_devices(DeviceType type)
+{
+	trace::Span span("PulseClient::populate_devices", "pulse");
+
+	std::vector<Device> devices;
+
+	switch (type) {
+		case DeviceType::SINK:
+			WaitOperationComplete(pa_context_get_sink_info_list(
+				context_, device_info_cb, static_cast<void *>(&devices)));
+			break;
+		case DeviceType::SOURCE:
+			WaitOperationComplete(pa_context_get_source_info_list(
+				context_, device_info_cb, static_cast<void *>(&devices)));
+			break;
+		case DeviceType::SINK_INPUT:
+			WaitOperationComplete(pa_context_get_sink_input_info_list(
+				context_, device_info_cb, static_cast<void *>(&devices)));
+			break;
+		case DeviceType::SOURCE_OUTPUT:
+			WaitOperationComplete(pa_context_get_source_output_info_list(
+				context_, device_info_cb, static_cast<void *>(&devices)));
+			break;
+	}
+
+	devices_of(type) = std::move(devices);
+	populated(type) = true;
+}
+
+void PulseClient::populate_pipelined()
+{
+	ServerInfo defaults;
+	std::vector<Device> sinks;
+	std::vector<Device> sink_inputs;
+	std::vector<Device> sources;
+	std::vector<Device> source_outputs;
+
+	// The daemon answers requests in order, so all replies are collected
+	// in roughly the time of the slowest query rather than the sum of all.
+	WaitOperationsComplete({
+		pa_context_get_server_info(context_, server_info_cb, &defaults),
+		pa_context_get_sink_info_list(context_, device_info_cb, static_cast<void *>(&sinks)),
+		pa_context_get_sink_input_info_list(context_, device_info_cb, static_cast<void *>(&sink_inputs)),
+		pa_context_get_source_info_list(context_, device_info_cb, static_cast<void *>(&sources)),
+		pa_context_get_source_output_info_list(context_, device_info_cb, static_cast<void *>(&source_outputs)),
+	});
+
+	defaults_ = std::move(defaults);
+	sinks_ = std::move(sinks);
+	sink_inputs_ = std::move(sink_inputs);
+	sources_ = std::move(sources);
+	source_outputs_ = std::move(source_outputs);
+}
+
 bool PulseClient::SetMute(Device &device, bool mute)
 {
+	trace::Span span("PulseClient::SetMute", "pulse");
+
 	int success;
 
-	if (device.ops_.Mute == nullptr) {
+	PulseDevice &pulse = pulse_of(device);
+	if (pulse.ops.Mute == nullptr) {
 		warnx("device does not support muting.");
 		return false;
 	}
 
-	WaitOperationComplete(device.ops_.Mute(
+	pulse.write_generation = ++write_generation_;
+	WaitOperationComplete(pulse.ops.Mute(
 		context_, device.index_, mute, success_cb, &success));
 
 	if (success) {
@@ -360,26 +600,119 @@ bool PulseClient::SetMute(Device &device, bool mute)
 
 bool PulseClient::SetVolume(Device &device, long volume)
 {
+	trace::Span span("PulseClient::SetVolume", "pulse");
+
 	int success;
 
-	if (device.ops_.SetVolume == nullptr) {
+	PulseDevice &pulse = pulse_of(device);
+	if (pulse.ops.SetVolume == nullptr) {
 		warnx("device does not support setting volume.");
 		return false;
 	}
 
 	volume = volume_range_.Clamp(volume);
-	const pa_cvolume *cvol = value_to_cvol(volume, &device.volume_);
-	WaitOperationComplete(device.ops_.SetVolume(
+	const pa_cvolume *cvol = value_to_cvol(volume, &pulse.volume);
+	pulse.write_generation = ++write_generation_;
+	WaitOperationComplete(pulse.ops.SetVolume(
 		context_, device.index_, cvol, success_cb, &success));
 
 	if (success) {
-		device.update_volume(*cvol);
+		update_volume(device, *cvol);
 		notifier_->Notify(NotificationType::VOLUME, device.volume_percent_, device.mute_);
 	}
 
 	return success;
 }
 
+bool PulseClient::QueueVolume(Device &device, long volume)
+{
+	trace::Span span("PulseClient::QueueVolume", "pulse");
+
+	PulseDevice &pulse = pulse_of(device);
+	if (pulse.ops.SetVolume == nullptr) {
+		warnx("device does not support setting volume.");
+		return false;
+	}
+
+	volume = volume_range_.Clamp(volume);
+	const pa_cvolume *cvol = value_to_cvol(volume, &pulse.volume);
+	update_volume(device, *cvol);
+	notifier_->Notify(NotificationType::VOLUME, device.volume_percent_, device.mute_);
+
+	auto [it, inserted] = volume_writes_.try_emplace({device.type_, device.index_});
+	VolumeWrite &write = it->second;
+	if (inserted) {
+		write = {this, device.type_, device.index_, pulse.ops.SetVolume, false, std::nullopt};
+	}
+
+	if (write.in_flight) {
+		write.next = *cvol;
+	} else {
+		send_volume(write, *cvol);
+	}
+
+	return true;
+}
+
+void PulseClient::Drain()
+{
+	trace::Span span("PulseClient::Drain", "pulse");
+
+	auto pending = [this]() {
+		for (auto const &[key, write] : volume_writes_) {
+			if (write.in_flight || write.next) return true;
+		}
+		return false;
+	};
+
+	// libpulse cancels outstanding operations without calling back when
+	// the context goes away, so a dead context would never drain.
+	int r;
+	while (pending()) {
+		if (pa_context_get_state(context_) != PA_CONTEXT_READY ||
+				pa_mainloop_iterate(mainloop_, 1, &r) < 0) {
+			fprintf(stderr, "dropping pending volume writes: %s\n", pa_strerror(pa_context_errno(context_)));
+			break;
+		}
+	}
+}
+
+void PulseClient::send_volume(VolumeWrite &write, const pa_cvolume &cvol)
+{
+	// Marks every update query sent before this write as stale.
+	if (Device *device = get_device(devices_of(write.type), write.index)) {
+		pulse_of(*device).write_generation = ++write_generation_;
+	}
+
+	pa_operation *op = write.set_volume(context_, write.index, &cvol, volume_written_cb, &write);
+	if (!op) {
+		fprintf(stderr, "failed to set volume: %s\n", pa_strerror(pa_context_errno(context_)));
+		write.in_flight = false;
+		write.next.reset();
+		// The cached volume is ahead of the daemon; fetch what it has.
+		request_update(write.type, write.index);
+		return;
+	}
+
+	write.in_flight = true;
+	write.next.reset();
+	pa_operation_unref(op);
+}
+
+void PulseClient::volume_written_cb(pa_context *context, int success, void *raw)
+{
+	auto write = static_cast<VolumeWrite *>(raw);
+	write->in_flight = false;
+
+	if (write->next) {
+		write->client->send_volume(*write, *write->next);
+	} else if (!success) {
+		fprintf(stderr, "operation failed: %s\n", pa_strerror(pa_context_errno(context)));
+		// The cached volume is ahead of the daemon; fetch what it has.
+		write->client->request_update(write->type, write->index);
+	}
+}
+
 bool PulseClient::IncreaseVolume(Device &device, long increment)
 {
 	return SetVolume(device, device.volume_percent_ + increment);
@@ -392,20 +725,24 @@ bool PulseClient::DecreaseVolume(Device &device, long increment)
 
 bool PulseClient::SetBalance(Device &device, long balance)
 {
-	if (device.ops_.SetVolume == nullptr) {
+	trace::Span span("PulseClient::SetBalance", "pulse");
+
+	PulseDevice &pulse = pulse_of(device);
+	if (pulse.ops.SetVolume == nullptr) {
 		warnx("device does not support setting balance.");
 		return false;
 	}
 
 	balance = balance_range_.Clamp(balance);
-	pa_cvolume *cvol = pa_cvolume_set_balance(&device.volume_, &device.channels_, balance / 100.0);
+	pa_cvolume *cvol = pa_cvolume_set_balance(&pulse.volume, &pulse.channels, balance / 100.0);
 
 	int success;
-	WaitOperationComplete(device.ops_.SetVolume(
+	pulse.write_generation = ++write_generation_;
+	WaitOperationComplete(pulse.ops.SetVolume(
 		context_, device.index_, cvol, success_cb, &success));
 
 	if (success) {
-		device.update_volume(*cvol);
+		update_volume(device, *cvol);
 		notifier_->Notify(NotificationType::BALANCE, device.balance_, false);
 	}
 
@@ -434,6 +771,8 @@ int PulseClient::GetBalance(const Device &device) const
 
 bool PulseClient::SetProfile(Card &card, const std::string &profile)
 {
+	trace::Span span("PulseClient::SetProfile", "pulse");
+
 	int success;
 	WaitOperationComplete(pa_context_set_card_profile_by_index(
 		context_, card.index_, profile.c_str(), success_cb, &success));
@@ -453,13 +792,16 @@ bool PulseClient::SetProfile(Card &card, const std::string &profile)
 
 bool PulseClient::Move(Device &source, Device &dest)
 {
-	if (source.ops_.Move == nullptr) {
+	trace::Span span("PulseClient::Move", "pulse");
+
+	const Operations &ops = pulse_of(source).ops;
+	if (ops.Move == nullptr) {
 		warnx("source device does not support moving.");
 		return false;
 	}
 
 	int success;
-	WaitOperationComplete(source.ops_.Move(
+	WaitOperationComplete(ops.Move(
 		context_, source.index_, dest.index_, success_cb, &success));
 
 	return success;
@@ -467,13 +809,16 @@ bool PulseClient::Move(Device &source, Device &dest)
 
 bool PulseClient::Kill(Device &device)
 {
-	if (device.ops_.Kill == nullptr) {
+	trace::Span span("PulseClient::Kill", "pulse");
+
+	const Operations &ops = pulse_of(device).ops;
+	if (ops.Kill == nullptr) {
 		warnx("source device does not support being killed.");
 		return false;
 	}
 
 	int success;
-	WaitOperationComplete(device.ops_.Kill(
+	WaitOperationComplete(ops.Kill(
 		context_, device.index_, success_cb, &success));
 
 	if (success) remove_device(device);
@@ -483,14 +828,17 @@ bool PulseClient::Kill(Device &device)
 
 bool PulseClient::SetDefault(Device &device)
 {
+	trace::Span span("PulseClient::SetDefault", "pulse");
+
 	int success;
 
-	if (device.ops_.SetDefault == nullptr) {
+	const Operations &ops = pulse_of(device).ops;
+	if (ops.SetDefault == nullptr) {
 		warnx("device does not support defaults");
 		return false;
 	}
 
-	WaitOperationComplete(device.ops_.SetDefault(
+	WaitOperationComplete(ops.SetDefault(
 		context_, device.name_.c_str(), success_cb, &success));
 
 	if (success) {
@@ -511,22 +859,7 @@ bool PulseClient::SetDefault(Device &device)
 
 void PulseClient::remove_device(Device &device)
 {
-	std::vector<Device> *devlist = nullptr;
-
-	switch (device.type_) {
-		case DeviceType::SINK:
-			devlist = &sinks_;
-			break;
-		case DeviceType::SINK_INPUT:
-			devlist = &sink_inputs_;
-			break;
-		case DeviceType::SOURCE:
-			devlist = &sources_;
-			break;
-		case DeviceType::SOURCE_OUTPUT:
-			devlist = &source_outputs_;
-			break;
-	}
+	std::vector<Device> *devlist = &devices_of(device.type_);
 	devlist->erase(
 		std::remove_if(
 			devlist->begin(), devlist->end(),
@@ -541,122 +874,228 @@ void PulseClient::SetNotifier(std::unique_ptr<Notifier> notifier)
 }
 
 //
-// Cards
+// Subscriptions
 //
-Card::Card(const pa_card_info *info)
-	: index_(info->index)
-	, name_(info->name)
-	, owner_module_(info->owner_module)
-	, driver_(info->driver)
-	, active_profile_(*info->active_profile)
+void PulseClient::Subscribe()
 {
-	for (int i = 0; info->profiles[i].name != nullptr; i++) {
-		profiles_.push_back(info->profiles[i]);
+	trace::Span span("PulseClient::Subscribe", "pulse");
+
+	int success;
+	pa_context_set_subscribe_callback(context_, subscribe_cb, this);
+	WaitOperationComplete(pa_context_subscribe(
+		context_,
+		static_cast<pa_subscription_mask_t>(PA_SUBSCRIPTION_MASK_SINK | PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_SINK_INPUT | PA_SUBSCRIPTION_MASK_SOURCE_OUTPUT | PA_SUBSCRIPTION_MASK_SERVER | PA_SUBSCRIPTION_MASK_CARD),
+		success_cb, &success));
+}
+
+void PulseClient::SetChangeCallback(ChangeCallback callback)
+{
+	change_callback_ = std::move(callback);
+}
+
+void PulseClient::SetWakeupFd(int fd)
+{
+	wakeup_fd_ = fd;
+	pa_mainloop_set_poll_func(mainloop_, fd >= 0 ? poll_cb : nullptr, this);
+}
+
+void PulseClient::Iterate(bool block)
+{
+	trace::Span span("PulseClient::Iterate", "pulse");
+
+	int r;
+	// Only the outermost iteration watches the wakeup fd; the nested ones
+	// in WaitOperationComplete would otherwise spin while it is readable.
+	wakeup_armed_ = block;
+	pa_mainloop_iterate(mainloop_, block, &r);
+	wakeup_armed_ = false;
+
+	apply_updates();
+}
+
+int PulseClient::poll_cb(struct pollfd *ufds, unsigned long nfds, int timeout, void *raw)
+{
+	auto self = static_cast<PulseClient *>(raw);
+	if (!self->wakeup_armed_) return poll(ufds, nfds, timeout);
+
+	self->poll_fds_.assign(ufds, ufds + nfds);
+	self->poll_fds_.push_back({self->wakeup_fd_, POLLIN, 0});
+
+	int r = poll(self->poll_fds_.data(), self->poll_fds_.size(), timeout);
+	if (r < 0) return r;
+
+	std::copy(self->poll_fds_.begin(), self->poll_fds_.begin() + nfds, ufds);
+	return self->poll_fds_.back().revents ? r - 1 : r;
+}
+
+void PulseClient::subscribe_cb(pa_context *context __attribute__((unused)), pa_subscription_event_type_t event, uint32_t index, void *raw)
+{
+	auto self = static_cast<PulseClient *>(raw);
+	auto const kind = event & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
+
+	DeviceType type;
+	switch (event & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
+		case PA_SUBSCRIPTION_EVENT_SINK:
+			type = DeviceType::SINK;
+			break;
+		case PA_SUBSCRIPTION_EVENT_SOURCE:
+			type = DeviceType::SOURCE;
+			break;
+		case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+			type = DeviceType::SINK_INPUT;
+			break;
+		case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT:
+			type = DeviceType::SOURCE_OUTPUT;
+			break;
+		case PA_SUBSCRIPTION_EVENT_SERVER:
+			pa_operation_unref(pa_context_get_server_info(self->context_, update_server_cb, self));
+			return;
+		case PA_SUBSCRIPTION_EVENT_CARD:
+			// Cards are refetched on next use; a hot-plugged card or a
+			// profile change would otherwise never show up.
+			self->cards_populated_ = false;
+			return;
+		default:
+			return;
+	}
+
+	if (kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+		self->updates_.push_back({ChangeType::DEVICE_REMOVED, type, index, std::nullopt, std::nullopt, self->write_generation_});
+	} else {
+		self->request_update(type, index);
 	}
 }
 
-//
-// Devices
-//
-Device::Device(const pa_sink_info *info)
-	: type_(DeviceType::SINK)
-	, index_(info->index)
-	, name_(info->name ? info->name : "")
-	, desc_(info->description)
-	, mute_(info->mute)
-	, card_idx_(info->card)
-{
-	update_volume(info->volume);
-	channels_ = info->channel_map;
-	balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
-
-	ops_.SetVolume = pa_context_set_sink_volume_by_index;
-	ops_.Mute = pa_context_set_sink_mute_by_index;
-	ops_.Kill = nullptr;
-	ops_.Move = nullptr;
-	ops_.SetDefault = pa_context_set_default_sink;
+void PulseClient::request_update(DeviceType type, uint32_t index)
+{
+	// A partially populated category only tracks the devices it already
+	// holds, so changes to anything else are of no interest.
+	if (!populated(type) && !get_device(devices_of(type), index)) return;
 
-	if (info->active_port) {
-		switch (info->active_port->available) {
-			case PA_PORT_AVAILABLE_YES:
-				available_ = Device::Availability::YES;
-				break;
-			case PA_PORT_AVAILABLE_NO:
-				available_ = Device::Availability::NO;
-				break;
-			case PA_PORT_AVAILABLE_UNKNOWN:
-				available_ = Device::Availability::UNKNOWN;
-				break;
-		}
+	pa_operation *op = nullptr;
+	switch (type) {
+		case DeviceType::SINK:
+			op = pa_context_get_sink_info_by_index(context_, index, update_device_cb, this);
+			break;
+		case DeviceType::SOURCE:
+			op = pa_context_get_source_info_by_index(context_, index, update_device_cb, this);
+			break;
+		case DeviceType::SINK_INPUT:
+			op = pa_context_get_sink_input_info(context_, index, update_device_cb, this);
+			break;
+		case DeviceType::SOURCE_OUTPUT:
+			op = pa_context_get_source_output_info(context_, index, update_device_cb, this);
+			break;
+	}
+	if (op) {
+		update_generations_.push_back(write_generation_);
+		pa_operation_unref(op);
 	}
 }
 
-Device::Device(const pa_source_info *info)
-	: type_(DeviceType::SOURCE)
-	, index_(info->index)
-	, name_(info->name ? info->name : "")
-	, desc_(info->description)
-	, mute_(info->mute)
-	, card_idx_(info->card)
+template <typename T>
+void PulseClient::update_device_cb(pa_context *context __attribute__((unused)), const T *info, int eol, void *raw)
 {
-	update_volume(info->volume);
-	channels_ = info->channel_map;
-	balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
+	auto self = static_cast<PulseClient *>(raw);
+	if (self->update_generations_.empty()) return;
+
+	// The device may be gone again by the time the query is answered,
+	// which ends the list without an entry; the remove event follows.
+	if (eol) {
+		self->update_generations_.pop_front();
+		return;
+	}
 
-	ops_.SetVolume = pa_context_set_source_volume_by_index;
-	ops_.Mute = pa_context_set_source_mute_by_index;
-	ops_.Kill = nullptr;
-	ops_.Move = nullptr;
-	ops_.SetDefault = pa_context_set_default_source;
+	Device device = make_device(info);
+	self->updates_.push_back({ChangeType::DEVICE_CHANGED, device.type_, device.index_, std::move(device), std::nullopt, self->update_generations_.front()});
 }
 
-Device::Device(const pa_sink_input_info *info)
-	: type_(DeviceType::SINK_INPUT)
-	, index_(info->index)
-	, name_(info->name ? info->name : "")
-	, mute_(info->mute)
-	, card_idx_(-1)
+void PulseClient::update_server_cb(pa_context *context, const pa_server_info *info, void *raw)
 {
-	update_volume(info->volume);
-	channels_ = info->channel_map;
-	balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
+	auto self = static_cast<PulseClient *>(raw);
+	ServerInfo defaults;
+	server_info_cb(context, info, &defaults);
+	self->updates_.push_back({ChangeType::DEFAULTS_CHANGED, DeviceType::SINK, PA_INVALID_INDEX, std::nullopt, std::move(defaults), self->write_generation_});
+}
 
-	const char *desc = pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME);
-	if (desc) desc_ = desc;
+void PulseClient::apply_updates()
+{
+	// Callbacks may issue further requests that queue more updates.
+	std::vector<Update> updates = std::move(updates_);
+	updates_.clear();
+
+	for (Update &update : updates) {
+		switch (update.change) {
+			case ChangeType::DEVICE_CHANGED:
+				{
+					std::vector<Device> &devices = devices_of(update.type);
+					if (Device *known = get_device(devices, update.index)) {
+						// Sent before our own latest write reached the daemon.
+						const uint64_t generation = pulse_of(*known).write_generation;
+						if (update.generation < generation) continue;
+						pulse_of(*update.device).write_generation = generation;
+						*known = std::move(*update.device);
+					} else if (populated(update.type)) {
+						devices.push_back(std::move(*update.device));
+					} else {
+						continue;
+					}
+					break;
+				}
+			case ChangeType::DEVICE_REMOVED:
+				{
+					Device *known = get_device(devices_of(update.type), update.index);
+					if (!known) continue;
+					remove_device(*known);
+					break;
+				}
+			case ChangeType::DEFAULTS_CHANGED:
+				if (update.defaults->sink == defaults_.sink && update.defaults->source == defaults_.source) continue;
+				defaults_.sink = update.defaults->sink;
+				defaults_.source = update.defaults->source;
+				break;
+		}
 
-	ops_.SetVolume = pa_context_set_sink_input_volume;
-	ops_.Mute = pa_context_set_sink_input_mute;
-	ops_.Kill = pa_context_kill_sink_input;
-	ops_.Move = pa_context_move_sink_input_by_index;
-	ops_.SetDefault = nullptr;
+		if (change_callback_) change_callback_(update.change, update.type, update.index);
+	}
 }
 
-Device::Device(const pa_source_output_info *info)
-	: type_(DeviceType::SOURCE_OUTPUT)
-	, index_(info->index)
-	, name_(info->name ? info->name : "")
-	, mute_(info->mute)
-	, card_idx_(-1)
+//
+// Cards
+//
+Card::Card(const pa_card_info *info)
+	: index_(info->index)
+	, name_(info->name)
+	, owner_module_(info->owner_module)
+	, driver_(info->driver)
+	, active_profile_(*info->active_profile)
 {
-	update_volume(info->volume);
-	volume_percent_ = volume_as_percent(&volume_);
-	balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
+	for (int i = 0; info->profiles[i].name != nullptr; i++) {
+		profiles_.push_back(info->profiles[i]);
+	}
+}
 
-	const char *desc = pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME);
-	if (desc) desc_ = desc;
+//
+// Devices
+//
+PulseDevice &PulseClient::pulse_of(Device &device)
+{
+	auto pulse = std::any_cast<PulseDevice>(&device.backend_);
+	if (!pulse) throw std::invalid_argument("device does not belong to pulse");
+	return *pulse;
+}
 
-	ops_.SetVolume = pa_context_set_source_output_volume;
-	ops_.Mute = pa_context_set_source_output_mute;
-	ops_.Kill = pa_context_kill_source_output;
-	ops_.Move = pa_context_move_source_output_by_index;
-	ops_.SetDefault = nullptr;
+const PulseDevice &PulseClient::pulse_of(const Device &device)
+{
+	return pulse_of(const_cast<Device &>(device));
 }
 
-void Device::update_volume(const pa_cvolume &newvol)
+void PulseClient::update_volume(Device &device, const pa_cvolume &cvol)
 {
-	volume_ = newvol;
-	volume_percent_ = volume_as_percent(&volume_);
-	balance_ = pa_cvolume_get_balance(&volume_, &channels_) * 100.0;
+	PulseDevice &pulse = pulse_of(device);
+	pulse.volume = cvol;
+	device.volume_percent_ = volume_as_percent(&pulse.volume);
+	device.balance_ = pa_cvolume_get_balance(&pulse.volume, &pulse.channels) * 100.0;
 }
 
 // vim: set et ts=2 sw=2:
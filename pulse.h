@@ -1,12 +1,19 @@
 #pragma once
 
+#include "mixer.h"
 #include "notify.h"
 
 // C
+#include <poll.h>
 #include <string.h>
 
 // C++
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <map>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -14,14 +21,6 @@
 // external
 #include <pulse/pulseaudio.h>
 
-enum class DeviceType
-{
-	SINK,
-	SOURCE,
-	SINK_INPUT,
-	SOURCE_OUTPUT,
-};
-
 struct Profile
 {
 	Profile(const pa_card_profile_info &info)
@@ -43,9 +42,9 @@ struct Operations
 	pa_operation *(*Move)(pa_context *, uint32_t, uint32_t, pa_context_success_cb_t, void *);
 };
 
-class Device
+// PulseClient's own state of a device, kept in the device's backend slot.
+struct PulseDevice
 {
-public:
 	enum class Availability
 	{
 		UNKNOWN = 0,
@@ -53,36 +52,14 @@ public:
 		YES,
 	};
 
-	Device(const pa_source_info *info);
-	Device(const pa_sink_info *info);
-	Device(const pa_sink_input_info *info);
-	Device(const pa_source_output_info *info);
-
-	uint32_t Index() const { return index_; }
-	const std::string &Name() const { return name_; }
-	const std::string &Desc() const { return desc_; }
-	int Volume() const { return volume_percent_; }
-	int Balance() const { return balance_; }
-	bool Muted() const { return mute_; }
-	DeviceType Type() const { return type_; }
-
-private:
-	friend class PulseClient;
-
-	void update_volume(const pa_cvolume &newvol);
-
-	DeviceType type_;
-	uint32_t index_;
-	std::string name_;
-	std::string desc_;
-	pa_cvolume volume_;
-	int volume_percent_;
-	pa_channel_map channels_;
-	int mute_;
-	int balance_;
-	uint32_t card_idx_;
-	Operations ops_;
-	Device::Availability available_ = Availability::UNKNOWN;
+	pa_cvolume volume;
+	pa_channel_map channels;
+	uint32_t card_idx = PA_INVALID_INDEX;
+	Operations ops = {};
+	Availability available = Availability::UNKNOWN;
+	// Value of PulseClient's write generation when this client last sent
+	// a change for the device; older subscription updates are stale.
+	uint64_t write_generation = 0;
 };
 
 class Card
@@ -108,25 +85,6 @@ private:
 	Profile active_profile_;
 };
 
-struct ServerInfo
-{
-	std::string sink;
-	std::string source;
-	std::string empty = "";
-
-	const std::string &GetDefault(DeviceType type)
-	{
-		switch (type) {
-			case DeviceType::SINK:
-				return sink;
-			case DeviceType::SOURCE:
-				return source;
-			default:
-				return empty;
-		}
-	}
-};
-
 template <typename T>
 struct Range
 {
@@ -152,51 +110,70 @@ struct Range
 	T max;
 };
 
-class PulseClient
+class PulseClient : public Mixer
 {
 public:
 	PulseClient(std::string client_name);
 	~PulseClient();
 
-	// Populates all known devices and cards. Any currently known
-	// devices and cards are cleared before the new data is stored.
-	void Populate();
+	// Populates all known devices. Any currently known devices and cards
+	// are cleared before the new data is stored.
+	void Populate(PopulateMode mode = PopulateMode::PIPELINED) override;
+
+	// Populates only the default sink or source, asking the daemon for
+	// nothing else. Any currently known devices and cards are cleared;
+	// every other category is loaded on first use. Returns the default
+	// device, or nullptr if there is none.
+	Device *PopulateDefault(DeviceType type) override;
 
 	// Get a device by index or name and type, or all devices by type.
-	Device *GetDevice(const uint32_t index, DeviceType type);
-	Device *GetDevice(const std::string &name, DeviceType type);
-	const std::vector<Device> &GetDevices(DeviceType type) const;
+	// Lookups that miss a partially populated category load it in full,
+	// which invalidates pointers previously returned for that category.
+	Device *GetDevice(const uint32_t index, DeviceType type) override;
+	Device *GetDevice(const std::string &name, DeviceType type) override;
+	const std::vector<Device> &GetDevices(DeviceType type) override;
 
 	// Get a sink by index or name, or all sinks.
 	Device *GetSink(const uint32_t index);
 	Device *GetSink(const std::string &name);
-	const std::vector<Device> &GetSinks() const { return sinks_; }
+	const std::vector<Device> &GetSinks() { return GetDevices(DeviceType::SINK); }
 
 	// Get a source by index or name, or all sources.
 	Device *GetSource(const uint32_t index);
 	Device *GetSource(const std::string &name);
-	const std::vector<Device> &GetSources() const { return sources_; }
+	const std::vector<Device> &GetSources() { return GetDevices(DeviceType::SOURCE); }
 
 	// Get a sink input by index or name, or all sink inputs.
 	Device *GetSinkInput(const uint32_t name);
 	Device *GetSinkInput(const std::string &name);
-	const std::vector<Device> &GetSinkInputs() const { return sink_inputs_; }
+	const std::vector<Device> &GetSinkInputs() { return GetDevices(DeviceType::SINK_INPUT); }
 
 	// Get a source output by index or name, or all source outputs.
 	Device *GetSourceOutput(const uint32_t name);
 	Device *GetSourceOutput(const std::string &name);
-	const std::vector<Device> &GetSourceOutputs() const { return source_outputs_; }
+	const std::vector<Device> &GetSourceOutputs() { return GetDevices(DeviceType::SOURCE_OUTPUT); }
 
 	// Get a card by index or name, all cards, or get the card which
-	// a sink is attached to.
+	// a sink is attached to. Cards and their profiles are not part of
+	// Populate(); they are fetched on first use and then served from the
+	// cache until the next Populate() or, once subscribed, card event.
 	Card *GetCard(const uint32_t index);
 	Card *GetCard(const std::string &name);
 	Card *GetCard(const Device &device);
-	const std::vector<Card> &GetCards() const { return cards_; }
+	const std::vector<Card> &GetCards();
 
 	// Get or set the volume of a device.
 	int GetVolume(const Device &device) const;
-	bool SetVolume(Device &device, long value);
+	bool SetVolume(Device &device, long value) override;
+
+	// Set the volume of a device without waiting for the daemon. At most
+	// one write per device is in flight; targets queued in the meantime
+	// collapse into the newest one, which is sent once the previous write
+	// completes. The cached volume is updated immediately.
+	bool QueueVolume(Device &device, long value) override;
+
+	// Blocks until every queued write was acknowledged by the daemon.
+	void Drain() override;
 
 	// Convenience wrappers for adjusting volume
 	bool IncreaseVolume(Device &device, long increment);
@@ -212,24 +189,24 @@ public:
 
 	// Get and set mute for a device.
 	bool IsMuted(const Device &device) const { return device.mute_; };
-	bool SetMute(Device &device, bool mute);
+	bool SetMute(Device &device, bool mute) override;
 
-	Device::Availability Availability(const Device &device) const
+	PulseDevice::Availability Availability(const Device &device) const
 	{
-		return device.available_;
+		return pulse_of(device).available;
 	}
 
 	// Set the profile for a card by name.
 	bool SetProfile(Card &card, const std::string &profile);
 
 	// Move a given source output or sink input to the destination.
-	bool Move(Device &source, Device &dest);
+	bool Move(Device &source, Device &dest) override;
 
 	// Kill a source output or sink input.
-	bool Kill(Device &device);
+	bool Kill(Device &device) override;
 
 	// Get or set the default sink and source.
-	const ServerInfo &GetDefaults() const { return defaults_; }
+	const ServerInfo &GetDefaults() const override { return defaults_; }
 	bool SetDefault(Device &device);
 
 	// Set minimum and maximum allowed volume
@@ -246,8 +223,60 @@ public:
 
 	void SetNotifier(std::unique_ptr<Notifier> notifier);
 
+	// Subscribes to sink, source, sink input, source output, server and
+	// card events. Each event refreshes only the affected entry of the known
+	// devices; the callback is run once the entry was updated. Updates
+	// are applied from Iterate() only, so device references held across
+	// other calls stay valid.
+	void Subscribe() override;
+	void SetChangeCallback(ChangeCallback callback) override;
+
+	// Runs one mainloop iteration and applies any updates received from
+	// a subscription. A blocking iteration also returns once the wakeup
+	// fd, if set, becomes readable.
+	void Iterate(bool block) override;
+	void SetWakeupFd(int fd) override;
+
 private:
+	struct Update
+	{
+		ChangeType change;
+		DeviceType type;
+		uint32_t index;
+		std::optional<Device> device;
+		std::optional<ServerInfo> defaults;
+		uint64_t generation;
+	};
+
 	void WaitOperationComplete(pa_operation *op);
+	void WaitOperationsComplete(std::initializer_list<pa_operation *> ops);
+
+	// The pulse side of a device; throws for devices of another backend.
+	static PulseDevice &pulse_of(Device &device);
+	static const PulseDevice &pulse_of(const Device &device);
+	static void update_volume(Device &device, const pa_cvolume &cvol);
+
+	static void subscribe_cb(pa_context *context, pa_subscription_event_type_t event, uint32_t index, void *raw);
+	template <typename T>
+	static void update_device_cb(pa_context *context, const T *info, int eol, void *raw);
+	static void update_server_cb(pa_context *context, const pa_server_info *info, void *raw);
+	static int poll_cb(struct pollfd *ufds, unsigned long nfds, int timeout, void *raw);
+
+	struct VolumeWrite
+	{
+		PulseClient *client;
+		DeviceType type;
+		uint32_t index;
+		pa_operation *(*set_volume)(pa_context *, uint32_t, const pa_cvolume *, pa_context_success_cb_t, void *);
+		bool in_flight;
+		std::optional<pa_cvolume> next;
+	};
+
+	static void volume_written_cb(pa_context *context, int success, void *raw);
+	void send_volume(VolumeWrite &write, const pa_cvolume &cvol);
+
+	void request_update(DeviceType type, uint32_t index);
+	void apply_updates();
 
 	template <class T>
 	T *find_fuzzy(std::vector<T> &haystack, const std::string &needle);
@@ -256,10 +285,18 @@ private:
 	void populate_cards();
 	void populate_sinks();
 	void populate_sources();
+	void populate_pipelined();
+	void populate_devices(DeviceType type);
+
+	std::vector<Device> &devices_of(DeviceType type);
+	bool &populated(DeviceType type) { return populated_[static_cast<size_t>(type)]; }
 
 	Device *get_device(std::vector<Device> &devices, const uint32_t index);
 	Device *get_device(std::vector<Device> &devices, const std::string &name);
 
+	template <typename Key>
+	Device *find_device(DeviceType type, const Key &key);
+
 	void remove_device(Device &device);
 
 	std::string client_name_;
@@ -270,24 +307,25 @@ private:
 	std::vector<Device> sink_inputs_;
 	std::vector<Device> source_outputs_;
 	std::vector<Card> cards_;
+	// Whether each device category holds the daemon's complete list or
+	// only what a targeted query returned, indexed by DeviceType.
+	bool populated_[4] = {};
+	bool cards_populated_ = false;
 	ServerInfo defaults_;
 	Range<int> volume_range_;
 	Range<int> balance_range_;
 	std::unique_ptr<Notifier> notifier_;
-};
-
-class unreachable : public std::runtime_error
-{
-public:
-	unreachable() throw()
-		: std::runtime_error("unreachable code path encountered")
-	{
-	}
-
-	unreachable(const std::string &message) throw()
-		: std::runtime_error(message)
-	{
-	}
+	ChangeCallback change_callback_;
+	std::vector<Update> updates_;
+	std::map<std::pair<DeviceType, uint32_t>, VolumeWrite> volume_writes_;
+	// Write generation at the time each outstanding update query was
+	// sent. The daemon answers in order, so the front belongs to the
+	// next reply.
+	std::deque<uint64_t> update_generations_;
+	uint64_t write_generation_ = 0;
+	int wakeup_fd_ = -1;
+	bool wakeup_armed_ = false;
+	std::vector<struct pollfd> poll_fds_;
 };
 
 // vim: set et ts=2 sw=2:
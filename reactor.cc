@@ -0,0 +1,157 @@
+// Self
+#include "reactor.h"
+
+// C
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// C++
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+std::runtime_error sys_error(const char *what)
+{
+	return std::runtime_error(std::string(what) + ": " + strerror(errno));
+}
+
+struct timespec to_timespec(std::chrono::nanoseconds ns)
+{
+	auto secs = std::chrono::duration_cast<std::chrono::seconds>(ns);
+	return {static_cast<time_t>(secs.count()), static_cast<long>((ns - secs).count())};
+}
+
+}  // namespace
+
+Reactor::Reactor()
+{
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0) throw sys_error("epoll_create1");
+}
+
+Reactor::~Reactor()
+{
+	for (auto &[fd, watch] : watches_) {
+		if (watch.timer) close(fd);
+	}
+	close(epoll_fd_);
+}
+
+void Reactor::add(int fd, Callback callback, bool timer)
+{
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) throw sys_error("epoll_ctl");
+
+	watches_[fd] = {std::move(callback), timer, false};
+}
+
+void Reactor::AddFd(int fd, Callback callback)
+{
+	add(fd, std::move(callback), false);
+}
+
+void Reactor::RemoveFd(int fd)
+{
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	watches_.erase(fd);
+}
+
+int Reactor::AddTimer(Callback callback)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) throw sys_error("timerfd_create");
+
+	add(fd, std::move(callback), true);
+	return fd;
+}
+
+void Reactor::ArmTimer(int timer, std::chrono::nanoseconds delay, std::chrono::nanoseconds interval)
+{
+	// A zero it_value disarms the timer, so fire "now" as soon as possible.
+	if (delay <= std::chrono::nanoseconds::zero()) delay = std::chrono::nanoseconds(1);
+
+	struct itimerspec spec = {to_timespec(interval), to_timespec(delay)};
+	if (timerfd_settime(timer, 0, &spec, nullptr) < 0) throw sys_error("timerfd_settime");
+	watches_.at(timer).armed = true;
+}
+
+void Reactor::DisarmTimer(int timer)
+{
+	struct itimerspec spec = {};
+	timerfd_settime(timer, 0, &spec, nullptr);
+	watches_.at(timer).armed = false;
+}
+
+bool Reactor::TimerArmed(int timer) const
+{
+	return watches_.at(timer).armed;
+}
+
+void Reactor::RemoveTimer(int timer)
+{
+	RemoveFd(timer);
+	close(timer);
+}
+
+void Reactor::SetPrepareCallback(Callback prepare)
+{
+	prepare_ = std::move(prepare);
+}
+
+void Reactor::SetWaiter(Callback waiter)
+{
+	waiter_ = std::move(waiter);
+}
+
+void Reactor::dispatch(int timeout)
+{
+	struct epoll_event events[16];
+	int n = epoll_wait(epoll_fd_, events, 16, timeout);
+	if (n < 0) {
+		if (errno == EINTR) return;
+		throw sys_error("epoll_wait");
+	}
+
+	for (int i = 0; i < n && running_; ++i) {
+		// An earlier callback in this batch may have removed the watch.
+		auto it = watches_.find(events[i].data.fd);
+		if (it == watches_.end()) continue;
+
+		if (it->second.timer) {
+			uint64_t expirations;
+			if (read(it->first, &expirations, sizeof(expirations)) < 0) continue;
+
+			struct itimerspec spec;
+			timerfd_gettime(it->first, &spec);
+			it->second.armed = spec.it_value.tv_sec || spec.it_value.tv_nsec;
+		}
+
+		// The callback may remove its own watch, so run a copy.
+		Callback callback = it->second.callback;
+		callback();
+	}
+}
+
+void Reactor::Run()
+{
+	running_ = true;
+	while (running_) {
+		if (prepare_) prepare_();
+		if (!running_) break;
+
+		if (waiter_) {
+			waiter_();
+			dispatch(0);
+		} else {
+			dispatch(-1);
+		}
+	}
+}
+
+// vim: set et ts=2 sw=2:
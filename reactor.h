@@ -0,0 +1,70 @@
+#pragma once
+
+// C++
+#include <chrono>
+#include <functional>
+#include <map>
+
+// Single threaded event loop around an epoll instance. It watches file
+// descriptors and owns timerfd based timers. The epoll fd itself becomes
+// readable whenever anything watched is ready, which lets another event
+// loop (the pulse mainloop, see PulseClient::SetWakeupFd) do the blocking
+// wait on the reactor's behalf.
+class Reactor
+{
+public:
+	using Callback = std::function<void()>;
+
+	Reactor();
+	~Reactor();
+
+	Reactor(const Reactor &) = delete;
+	Reactor &operator=(const Reactor &) = delete;
+
+	// Readable whenever a watched fd or timer is ready.
+	int Fd() const { return epoll_fd_; }
+
+	// Watch a file descriptor for readability.
+	void AddFd(int fd, Callback callback);
+	void RemoveFd(int fd);
+
+	// Create a disarmed timer and return its id. Arming it with a zero
+	// interval makes it fire once.
+	int AddTimer(Callback callback);
+	void ArmTimer(int timer, std::chrono::nanoseconds delay, std::chrono::nanoseconds interval = std::chrono::nanoseconds::zero());
+	void DisarmTimer(int timer);
+	bool TimerArmed(int timer) const;
+	void RemoveTimer(int timer);
+
+	// Run before every blocking wait, e.g. to flush buffered requests or
+	// handle input that was already read from a socket.
+	void SetPrepareCallback(Callback prepare);
+
+	// Replace the blocking wait. The waiter must return once Fd() is
+	// readable; without one the reactor blocks in epoll_wait itself.
+	void SetWaiter(Callback waiter);
+
+	// Dispatch ready callbacks until Stop() is called.
+	void Run();
+	void Stop() { running_ = false; }
+	bool Running() const { return running_; }
+
+private:
+	struct Watch
+	{
+		Callback callback;
+		bool timer;
+		bool armed;
+	};
+
+	void add(int fd, Callback callback, bool timer);
+	void dispatch(int timeout);
+
+	int epoll_fd_;
+	bool running_ = false;
+	std::map<int, Watch> watches_;
+	Callback prepare_;
+	Callback waiter_;
+};
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,208 @@
+// Self
+#include "render.h"
+
+#include "pixels.h"
+#include "stats.h"
+
+// C
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+// C++
+#include <algorithm>
+
+SoftwareRenderer::SoftwareRenderer(xcb_connection_t *connection, xcb_screen_t *screen)
+	: connection_(connection)
+	, depth_(screen->root_depth)
+{
+	const xcb_query_extension_reply_t *ext = stats::Blocking("xcb_get_extension_data", [this] { return xcb_get_extension_data(connection_, &xcb_shm_id); });
+	if (ext && ext->present) {
+		shm_event_base_ = ext->first_event;
+		shm_available_ = true;
+	}
+}
+
+SoftwareRenderer::~SoftwareRenderer()
+{
+	detach_shm();
+}
+
+bool SoftwareRenderer::Supported(xcb_connection_t *connection, xcb_screen_t *screen, const xcb_visualtype_t *visual)
+{
+	if (!visual || visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR) return false;
+	if (visual->red_mask != 0xFF0000 || visual->green_mask != 0xFF00 || visual->blue_mask != 0xFF) return false;
+	if (screen->root_depth != 24 && screen->root_depth != 32) return false;
+
+	const xcb_setup_t *setup = xcb_get_setup(connection);
+	const uint16_t probe = 1;
+	const bool host_lsb = *reinterpret_cast<const uint8_t *>(&probe) == 1;
+	if ((setup->image_byte_order == XCB_IMAGE_ORDER_LSB_FIRST) != host_lsb) return false;
+
+	for (auto format = xcb_setup_pixmap_formats_iterator(setup); format.rem; xcb_format_next(&format)) {
+		if (format.data->depth == screen->root_depth) {
+			return format.data->bits_per_pixel == 32 && format.data->scanline_pad == 32;
+		}
+	}
+	return false;
+}
+
+void SoftwareRenderer::SetColors(uint32_t bar, uint32_t bar_muted, uint32_t background)
+{
+	bar_ = bar;
+	bar_muted_ = bar_muted;
+	background_ = background;
+	level_ = -1;
+}
+
+bool SoftwareRenderer::attach_shm(size_t bytes)
+{
+	int shmid = shmget(IPC_PRIVATE, bytes, IPC_CREAT | 0600);
+	if (shmid < 0) return false;
+
+	void *addr = shmat(shmid, nullptr, 0);
+	if (addr == reinterpret_cast<void *>(-1)) {
+		shmctl(shmid, IPC_RMID, nullptr);
+		return false;
+	}
+
+	// The attach is checked once per allocation: it is what fails on
+	// remote displays, and the segment may only be removed afterwards.
+	xcb_shm_seg_t seg = xcb_generate_id(connection_);
+	auto attach = xcb_shm_attach_checked(connection_, seg, shmid, 0);
+	xcb_generic_error_t *err = stats::Blocking("xcb_request_check", [&] { return xcb_request_check(connection_, attach); });
+	shmctl(shmid, IPC_RMID, nullptr);
+	if (err) {
+		free(err);
+		shmdt(addr);
+		return false;
+	}
+
+	shmseg_ = seg;
+	pixels_ = static_cast<uint32_t *>(addr);
+	return true;
+}
+
+void SoftwareRenderer::detach_shm()
+{
+	if (!shmseg_) return;
+	xcb_shm_detach(connection_, shmseg_);
+	shmdt(pixels_);
+	shmseg_ = 0;
+	pixels_ = nullptr;
+}
+
+void SoftwareRenderer::Resize(uint16_t width, uint16_t height)
+{
+	if (width == width_ && height == height_) return;
+	width_ = width;
+	height_ = height;
+	level_ = -1;
+
+	const size_t needed = static_cast<size_t>(width) * height;
+	if (needed <= capacity_) return;
+
+	detach_shm();
+	if (shm_available_ && attach_shm(needed * sizeof(uint32_t))) {
+		fallback_.clear();
+		fallback_.shrink_to_fit();
+	} else {
+		shm_available_ = false;
+		fallback_.resize(needed);
+		pixels_ = fallback_.data();
+	}
+	capacity_ = needed;
+}
+
+void SoftwareRenderer::rasterize(uint16_t first_row, uint16_t last_row)
+{
+	const uint32_t bar = muted_ ? bar_muted_ : bar_;
+	// The bar's top edge in whole rows plus the coverage of the partial
+	// row above it.
+	const int full_rows = level_ >> 8;
+	const uint16_t coverage = level_ & 0xFF;
+	const int bar_top = height_ - full_rows;
+
+	for (int y = first_row; y < last_row; ++y) {
+		uint32_t *row = pixels_ + static_cast<size_t>(y) * width_;
+		if (y >= bar_top) {
+			// Lighter towards the top of the bar.
+			pixels::FillSpan(row, pixels::Lighten(bar, 64 * (height_ - y) / std::max<int>(height_, 1)), width_);
+		} else {
+			pixels::FillSpan(row, background_, width_);
+			if (y == bar_top - 1 && coverage) {
+				pixels::BlendSpan(row, pixels::Lighten(bar, 64), coverage, width_);
+			}
+		}
+	}
+}
+
+void SoftwareRenderer::present(xcb_window_t window, xcb_gcontext_t gc, uint16_t x, uint16_t y, uint16_t width, uint16_t height)
+{
+	if (!width || !height) return;
+
+	if (shmseg_) {
+		xcb_shm_put_image(connection_, window, gc, width_, height_, x, y, width, height, x, y, depth_, XCB_IMAGE_FORMAT_Z_PIXMAP, 1, shmseg_, 0);
+		busy_ = true;
+		return;
+	}
+
+	// Without SHM the rows travel in the request; split them so no request
+	// exceeds the server's limit. Only full rows are sent.
+	const size_t max_bytes = static_cast<size_t>(xcb_get_maximum_request_length(connection_)) * 4 - 64;
+	const size_t row_bytes = static_cast<size_t>(width_) * sizeof(uint32_t);
+	// BIG-REQUESTS allows more rows than a request can describe.
+	const size_t rows_per_request = std::clamp<size_t>(max_bytes / row_bytes, 1, UINT16_MAX);
+	const size_t end = static_cast<size_t>(y) + height;
+	for (size_t row = y; row < end; row += rows_per_request) {
+		const size_t rows = std::min(rows_per_request, end - row);
+		xcb_put_image(connection_, XCB_IMAGE_FORMAT_Z_PIXMAP, window, gc, width_, static_cast<uint16_t>(rows), 0, static_cast<int16_t>(row), 0, depth_, static_cast<uint32_t>(rows * row_bytes), reinterpret_cast<const uint8_t *>(pixels_ + row * width_));
+	}
+}
+
+void SoftwareRenderer::Draw(xcb_window_t window, xcb_gcontext_t gc, int volume, bool muted)
+{
+	if (!pixels_ || busy_) return;
+
+	const int level = std::clamp(height_ * volume * 256 / 100, 0, height_ * 256);
+	uint16_t first = 0, last = height_;
+
+	if (level_ >= 0 && muted == muted_) {
+		if (level == level_) return;
+		// Only the rows between the old and new edge change, including the
+		// partially covered row above each edge.
+		int low = std::min(level, level_) >> 8, high = (std::max(level, level_) + 255) >> 8;
+		first = std::max(0, height_ - high - 1);
+		last = std::min<int>(height_, height_ - low + 1);
+	}
+
+	level_ = level;
+	muted_ = muted;
+	rasterize(first, last);
+	present(window, gc, 0, first, width_, last - first);
+}
+
+bool SoftwareRenderer::Expose(xcb_window_t window, xcb_gcontext_t gc, uint16_t x, uint16_t y, uint16_t width, uint16_t height)
+{
+	if (!pixels_ || level_ < 0) return false;
+	if (busy_) {
+		// The next Draw() has to present everything.
+		level_ = -1;
+		return false;
+	}
+
+	width = std::min<int>(width, width_ - std::min(x, width_));
+	height = std::min<int>(height, height_ - std::min(y, height_));
+	present(window, gc, x, y, width, height);
+	return true;
+}
+
+bool SoftwareRenderer::HandleEvent(const xcb_generic_event_t *ev)
+{
+	if (!shm_available_ || (ev->response_type & ~0x80) != shm_event_base_ + XCB_SHM_COMPLETION) return false;
+	busy_ = false;
+	return true;
+}
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,80 @@
+#pragma once
+
+// C
+#include <stdint.h>
+
+// C++
+#include <vector>
+
+// external
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+
+// Software renderer for the overlay. Every frame is rasterized on the
+// client into a 32 bit XRGB image, with a vertical gradient on the bar and
+// an anti-aliased top edge, and presented with a single put image request.
+// The image lives in MIT-SHM shared memory when the server supports it;
+// otherwise it is sent over the wire with xcb_put_image.
+class SoftwareRenderer
+{
+public:
+	SoftwareRenderer(xcb_connection_t *connection, xcb_screen_t *screen);
+	~SoftwareRenderer();
+
+	SoftwareRenderer(const SoftwareRenderer &) = delete;
+	SoftwareRenderer &operator=(const SoftwareRenderer &) = delete;
+
+	// Whether images in our layout can be put on the screen as they are:
+	// a 24 or 32 bit TrueColor visual with 8 bit channels, 32 bits per
+	// pixel and the host's byte order.
+	static bool Supported(xcb_connection_t *connection, xcb_screen_t *screen, const xcb_visualtype_t *visual);
+
+	bool UsingShm() const { return shmseg_ != 0; }
+
+	// Colours are 0xRRGGBB.
+	void SetColors(uint32_t bar, uint32_t bar_muted, uint32_t background);
+	void Resize(uint16_t width, uint16_t height);
+
+	// Rasterizes the overlay at the given volume (0-100) and presents the
+	// rows that changed since the previous frame.
+	void Draw(xcb_window_t window, xcb_gcontext_t gc, int volume, bool muted);
+
+	// Presents an area of the last frame again. Returns false if that is
+	// not possible right now and a full frame has to be drawn instead.
+	bool Expose(xcb_window_t window, xcb_gcontext_t gc, uint16_t x, uint16_t y, uint16_t width, uint16_t height);
+
+	// A shared memory image may not be touched until the server has read
+	// it. While busy, Draw() must not be called.
+	bool Busy() const { return busy_; }
+
+	// Consumes the SHM completion event for our last put; returns whether
+	// the event was one.
+	bool HandleEvent(const xcb_generic_event_t *ev);
+
+private:
+	bool attach_shm(size_t bytes);
+	void detach_shm();
+	void rasterize(uint16_t first_row, uint16_t last_row);
+	void present(xcb_window_t window, xcb_gcontext_t gc, uint16_t x, uint16_t y, uint16_t width, uint16_t height);
+
+	xcb_connection_t *connection_;
+	uint8_t depth_;
+	uint8_t shm_event_base_ = 0;
+	bool shm_available_ = false;
+
+	xcb_shm_seg_t shmseg_ = 0;
+	uint32_t *pixels_ = nullptr;
+	size_t capacity_ = 0;
+	std::vector<uint32_t> fallback_;
+
+	uint16_t width_ = 0, height_ = 0;
+	uint32_t bar_ = 0, bar_muted_ = 0, background_ = 0;
+
+	// Bar height in 1/256 pixels and mute state of the last frame; a
+	// negative level forces a full frame.
+	int level_ = -1;
+	bool muted_ = false;
+	bool busy_ = false;
+};
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,82 @@
+// Self
+#include "stats.h"
+
+// C++
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace stats
+{
+namespace detail
+{
+bool enabled = false;
+}
+
+namespace
+{
+struct Entry
+{
+	unsigned long count = 0;
+	std::chrono::nanoseconds blocked = std::chrono::nanoseconds::zero();
+};
+
+// Pulse is set up on a worker thread while X is set up on the main one.
+std::mutex mutex;
+std::vector<std::string> phases;
+std::map<std::pair<std::string, std::string>, Entry> entries;
+
+thread_local const char *current_phase = "init";
+
+double ms(std::chrono::nanoseconds ns)
+{
+	return std::chrono::duration<double, std::milli>(ns).count();
+}
+
+}  // namespace
+
+void Enable()
+{
+	detail::enabled = true;
+}
+
+void SetPhase(const char *phase)
+{
+	current_phase = phase;
+}
+
+void Record(const char *call, std::chrono::nanoseconds blocked)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto key = std::make_pair(std::string(current_phase), std::string(call));
+	if (std::find(phases.begin(), phases.end(), key.first) == phases.end()) phases.push_back(key.first);
+
+	Entry &entry = entries[key];
+	entry.count++;
+	entry.blocked += blocked;
+}
+
+void Summary(FILE *out)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	fprintf(out, "%-14s %-32s %7s %12s\n", "phase", "call", "count", "blocked ms");
+
+	// Phases in the order they were first seen.
+	for (auto const &phase : phases) {
+		Entry total;
+		for (auto const &[key, entry] : entries) {
+			if (key.first != phase) continue;
+			fprintf(out, "%-14s %-32s %7lu %12.3f\n", phase.c_str(), key.second.c_str(), entry.count, ms(entry.blocked));
+			total.count += entry.count;
+			total.blocked += entry.blocked;
+		}
+		fprintf(out, "%-14s %-32s %7lu %12.3f\n", phase.c_str(), "total", total.count, ms(total.blocked));
+	}
+}
+
+}  // namespace stats
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "trace.h"
+
+// C
+#include <stdio.h>
+
+// C++
+#include <chrono>
+#include <type_traits>
+
+// Round trip accounting for --stats. Calls that block on the X server or
+// the pulse daemon are wrapped in Blocking(), which counts them together
+// with the time they blocked under the calling thread's current phase.
+// With --trace every wrapped call also becomes a span. While both are off
+// a wrapped call costs a single branch.
+namespace stats
+{
+namespace detail
+{
+extern bool enabled;
+}
+
+inline bool Enabled()
+{
+	return detail::enabled;
+}
+
+void Enable();
+
+// Names the phase later calls on this thread are accounted to.
+void SetPhase(const char *phase);
+
+void Record(const char *call, std::chrono::nanoseconds blocked);
+
+// Prints count and blocked time per phase and call.
+void Summary(FILE *out);
+
+template <typename F>
+auto Blocking(const char *call, F &&fn)
+{
+	if (!Enabled() && !trace::Enabled()) return fn();
+
+	auto start = std::chrono::steady_clock::now();
+	auto done = [call, start]() {
+		auto end = std::chrono::steady_clock::now();
+		if (Enabled()) Record(call, end - start);
+		if (trace::Enabled()) trace::Complete(call, "round-trip", start, end);
+	};
+	if constexpr (std::is_void_v<decltype(fn())>) {
+		fn();
+		done();
+	} else {
+		auto result = fn();
+		done();
+		return result;
+	}
+}
+
+}  // namespace stats
+
+// vim: set et ts=2 sw=2:
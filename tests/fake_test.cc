@@ -0,0 +1,90 @@
+// Feeds fixed QueueVolume sequences through FakeMixer and checks how many
+// writes reach the fake server and how many targets were coalesced away.
+
+#include "fake.h"
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+
+// C++
+#include <chrono>
+
+using namespace std::chrono_literals;
+
+template <typename A, typename E>
+static void check_eq(const char *what, int line, A actual, E expected)
+{
+	if (actual == static_cast<A>(expected)) return;
+	fprintf(stderr, "%s:%d: %s is %ld, expected %ld\n", __FILE__, line, what, (long)actual, (long)expected);
+	exit(1);
+}
+
+#define CHECK_EQ(actual, expected) check_eq(#actual, __LINE__, (actual), (expected))
+
+// Nothing completes without the reactor, so the first target is in flight
+// and every later one replaces the queued target. Drain sends the last.
+static void burst_then_drain()
+{
+	Reactor reactor;
+	FakeMixer mixer(reactor, 0ns);
+	Device *sink = mixer.GetDevice("fake_sink", DeviceType::SINK);
+
+	for (long volume : {51, 52, 53, 54, 55}) {
+		mixer.QueueVolume(*sink, volume);
+	}
+	CHECK_EQ(mixer.GetCounters().writes, 1);
+	CHECK_EQ(mixer.GetCounters().coalesced, 3);
+
+	mixer.Drain();
+	CHECK_EQ(mixer.GetCounters().writes, 2);
+	CHECK_EQ(mixer.GetCounters().coalesced, 3);
+	CHECK_EQ(sink->Volume(), 55);
+}
+
+// With the reactor running each acknowledgement sends the newest queued
+// target, and a write to another device is never coalesced with it.
+static void burst_through_reactor()
+{
+	Reactor reactor;
+	FakeMixer mixer(reactor, 1ms);
+	Device *sink = mixer.GetDevice("fake_sink", DeviceType::SINK);
+	Device *stream = mixer.GetDevice("fake_stream", DeviceType::SINK_INPUT);
+
+	mixer.Subscribe();
+	int changes = 0;
+	mixer.SetChangeCallback([&changes](Mixer::ChangeType, DeviceType, uint32_t) { changes++; });
+
+	for (long volume : {40, 30, 20, 10}) {
+		mixer.QueueVolume(*sink, volume);
+	}
+	mixer.QueueVolume(*stream, 80);
+
+	int stop = reactor.AddTimer([&reactor]() { reactor.Stop(); });
+	reactor.ArmTimer(stop, 50ms);
+	reactor.Run();
+	mixer.Iterate(false);
+
+	// 40 and 80 go out at once, 10 after 40 is acknowledged; 30 and 20
+	// were replaced while they waited.
+	CHECK_EQ(mixer.GetCounters().writes, 3);
+	CHECK_EQ(mixer.GetCounters().coalesced, 2);
+	CHECK_EQ(changes, 3);
+	CHECK_EQ(sink->Volume(), 10);
+	CHECK_EQ(stream->Volume(), 80);
+
+	// Everything was acknowledged, so there is nothing left to drain.
+	mixer.Drain();
+	CHECK_EQ(mixer.GetCounters().writes, 3);
+	reactor.RemoveTimer(stop);
+}
+
+int main()
+{
+	burst_then_drain();
+	burst_through_reactor();
+	printf("fake_test: ok\n");
+	return 0;
+}
+
+// vim: set et ts=2 sw=2:
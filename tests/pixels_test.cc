@@ -0,0 +1,74 @@
+// Compares the span kernels against a per-channel scalar reference, with
+// every start alignment and lengths that leave a tail after the SSE2 loop.
+
+#include "pixels.h"
+
+// C
+#include <stdio.h>
+#include <stdlib.h>
+
+// C++
+#include <random>
+#include <vector>
+
+static uint32_t blend_reference(uint32_t dst, uint32_t color, uint32_t alpha)
+{
+	uint32_t out = 0;
+	for (int shift = 0; shift < 32; shift += 8) {
+		uint32_t s = (color >> shift) & 0xFF, d = (dst >> shift) & 0xFF;
+		out |= ((s * alpha + d * (256 - alpha)) / 256) << shift;
+	}
+	return out;
+}
+
+static int failures = 0;
+
+static void check_span(const char *kernel, const std::vector<uint32_t> &got, const std::vector<uint32_t> &want, size_t start, size_t n, unsigned alpha)
+{
+	for (size_t i = 0; i < got.size(); ++i) {
+		if (got[i] == want[i]) continue;
+		fprintf(stderr, "%s start=%zu n=%zu alpha=%u: pixel %zu is %08x, expected %08x\n", kernel, start, n, alpha, i, got[i], want[i]);
+		failures++;
+		return;
+	}
+}
+
+int main()
+{
+	const unsigned alphas[] = {0, 1, 64, 127, 128, 200, 255, 256};
+	const uint32_t colors[] = {0x00000000, 0xFFFFFFFF, 0x00A6E22E, 0x80FF4535};
+	// Pixels past the span must come out untouched.
+	const size_t guard = 5;
+
+	std::mt19937 random(1);
+	std::vector<uint32_t> before(3 + 37 + guard);
+
+	for (size_t start = 0; start < 4; ++start) {
+		for (size_t n = 0; n <= 37; ++n) {
+			for (uint32_t color : colors) {
+				for (auto &p : before) p = random();
+
+				auto got = before, want = before;
+				pixels::FillSpan(got.data() + start, color, n);
+				for (size_t i = start; i < start + n; ++i) want[i] = color;
+				check_span("FillSpan", got, want, start, n, 256);
+
+				for (unsigned alpha : alphas) {
+					got = want = before;
+					pixels::BlendSpan(got.data() + start, color, alpha, n);
+					for (size_t i = start; i < start + n; ++i) want[i] = blend_reference(before[i], color, alpha);
+					check_span("BlendSpan", got, want, start, n, alpha);
+				}
+			}
+		}
+	}
+
+	if (failures) {
+		fprintf(stderr, "pixels_test: %d failure(s)\n", failures);
+		return 1;
+	}
+	printf("pixels_test: ok\n");
+	return 0;
+}
+
+// vim: set et ts=2 sw=2:
@@ -0,0 +1,128 @@
+// Self
+#include "trace.h"
+
+// C
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+// C++
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace trace
+{
+namespace detail
+{
+bool enabled = false;
+}
+
+namespace
+{
+struct Event
+{
+	const char *name;
+	const char *category;
+	int64_t start_ns;
+	int64_t duration_ns;
+	int tid;
+};
+
+// A daemon records for as long as it runs, so only the newest events are
+// kept: once the buffer is full each event replaces the oldest one.
+constexpr size_t MAX_EVENTS = 1 << 16;
+
+// Pulse is set up on a worker thread while X is set up on the main one.
+std::mutex mutex;
+std::vector<Event> events;
+size_t oldest = 0;
+uint64_t dropped = 0;
+std::vector<std::pair<int, std::string>> thread_names;
+std::string output_path;
+std::chrono::steady_clock::time_point origin;
+
+// Small sequential ids read better in trace viewers than kernel tids.
+std::atomic<int> next_tid{1};
+thread_local int tid = next_tid++;
+
+void write_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\') fputc('\\', out);
+		fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+}  // namespace
+
+void Start(const char *path)
+{
+	output_path = path;
+	origin = std::chrono::steady_clock::now();
+	events.reserve(MAX_EVENTS);
+	detail::enabled = true;
+}
+
+void SetThreadName(const char *name)
+{
+	if (!Enabled()) return;
+	std::lock_guard<std::mutex> lock(mutex);
+	thread_names.emplace_back(tid, name);
+}
+
+void Complete(const char *name, const char *category, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	using std::chrono::duration_cast;
+	using std::chrono::nanoseconds;
+	Event event = {name, category, duration_cast<nanoseconds>(start - origin).count(), duration_cast<nanoseconds>(end - start).count(), tid};
+	if (events.size() < MAX_EVENTS) {
+		events.push_back(event);
+		return;
+	}
+	events[oldest] = event;
+	oldest = (oldest + 1) % MAX_EVENTS;
+	++dropped;
+}
+
+bool Write()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	FILE *out = fopen(output_path.c_str(), "w");
+	if (!out) return false;
+
+	const int pid = getpid();
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (auto const &[thread, name] : thread_names) {
+		fprintf(out, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", first ? "" : ",\n", pid, thread);
+		write_string(out, name.c_str());
+		fprintf(out, "}}");
+		first = false;
+	}
+	if (dropped) {
+		fprintf(out, "%s{\"ph\":\"M\",\"name\":\"process_labels\",\"pid\":%d,\"args\":{\"labels\":\"%llu older events dropped\"}}", first ? "" : ",\n", pid, (unsigned long long)dropped);
+		first = false;
+	}
+	// Timestamps are in microseconds.
+	for (size_t i = 0; i < events.size(); ++i) {
+		auto const &e = events[(oldest + i) % events.size()];
+		fprintf(out, "%s{\"ph\":\"X\",\"name\":", first ? "" : ",\n");
+		write_string(out, e.name);
+		fprintf(out, ",\"cat\":");
+		write_string(out, e.category);
+		fprintf(out, ",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}", e.start_ns / 1000.0, e.duration_ns / 1000.0, pid, e.tid);
+		first = false;
+	}
+	fprintf(out, "\n]}\n");
+	return fclose(out) == 0;
+}
+
+}  // namespace trace
+
+// vim: set et ts=2 sw=2:
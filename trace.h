@@ -0,0 +1,59 @@
+#pragma once
+
+// C++
+#include <chrono>
+
+// Chrome trace-event export (--trace FILE). The newest spans are kept in
+// a fixed-size buffer and written as trace-event JSON on exit, which
+// chrome://tracing and Perfetto open directly. While tracing is off a
+// Span is one branch on construction and one on destruction.
+namespace trace
+{
+namespace detail
+{
+extern bool enabled;
+}
+
+inline bool Enabled()
+{
+	return detail::enabled;
+}
+
+// Starts recording; Write() saves everything recorded to path.
+void Start(const char *path);
+bool Write();
+
+// Names the calling thread in the trace.
+void SetThreadName(const char *name);
+
+// Name and category must outlive the trace, e.g. string literals.
+void Complete(const char *name, const char *category, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end);
+
+// Records the lifetime of the scope it is declared in.
+class Span
+{
+public:
+	explicit Span(const char *name, const char *category = "paup")
+		: name_(Enabled() ? name : nullptr)
+		, category_(category)
+	{
+		if (name_) start_ = std::chrono::steady_clock::now();
+	}
+
+	~Span()
+	{
+		if (name_) Complete(name_, category_, start_, std::chrono::steady_clock::now());
+	}
+
+	Span(const Span &) = delete;
+	Span &operator=(const Span &) = delete;
+
+private:
+	const char *name_;
+	const char *category_;
+	std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace trace
+
+// vim: set et ts=2 sw=2: